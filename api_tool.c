@@ -1,6 +1,6 @@
 // api_tool.c - generate api.def + index.json + auto_import.h, with
 // public/private filtering Build:
-//   cc -O2 -Wall -Wextra -std=c11 api_tool.c -o api_tool
+//   cc -O2 -Wall -Wextra -std=c11 -pthread api_tool.c -o api_tool
 //
 // Commands:
 //   ./api_tool gen --root . --out framework/api.def --index
@@ -10,6 +10,11 @@
 //   --vis public
 //   ./api_tool needs --root . --entry game.c --out framework/auto_import.h
 //   --vis private --preprocess "cc -E -P -I. game.c"
+//   ./api_tool needs --root . --compile-commands compile_commands.json
+//   --auto_out "generated/{stem}_import.h" --vis public
+//   --preprocess "cc -E -P -I. {file}"
+//   ./api_tool serve --root .   (then any command above with --socket
+//   .api_tool.sock is answered from memory)
 //
 // Visibility rules (generator):
 //   - If file path contains "/include/" or "/public/" -> PUBLIC
@@ -20,21 +25,48 @@
 //
 // Notes:
 // - Heuristic parser, but fully working for conventional C style.
-// - Multi-line prototypes are handled in "needs" (identifier scan), but
-// extraction focuses on common forms.
+// - Function signatures may be wrapped over several lines; extraction runs
+// to the terminating ';' or '{' at brace depth 0.
 
 #define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE  // d_type and DT_* on glibc
+#define _DARWIN_C_SOURCE // and on macOS
+#if defined(__linux__)
+#define _GNU_SOURCE // struct ucred, for the server's SO_PEERCRED check
+#endif
 
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
-#include <regex.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#endif
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 typedef enum {
   SYM_FN_PROTO,
@@ -45,22 +77,37 @@ typedef enum {
 
 typedef enum { VIS_PRIVATE = 0, VIS_PUBLIC = 1 } Visibility;
 
+// Interned string (see intern()); equal strings have equal ids.
+typedef uint32_t StrId;
+#define STR_NONE UINT32_MAX
+
 typedef struct {
   SymKind kind;
   Visibility vis;
-  char *name;
-  char *file;
+  StrId name;
+  StrId file; // path relative to the scan root
   int line_start;
   int line_end;
-  char *backend; // "core" | "sdl" | "raylib" | ...
-  char *snippet; // raw snippet lines
+  StrId backend; // "core" | "sdl" | "raylib" | ...
+  const struct SrcFile *src; // buffer holding the snippet
+  size_t snippet_off; // snippet: whole source lines [off, off + len) of src,
+  size_t snippet_len; // materialized with sym_snippet() when emitted
   char *sigline; // for functions: normalized first-line signature (best-effort)
 } Symbol;
 
+typedef struct SrcFile {
+  char *data;
+  size_t len;
+  size_t map_len; // nonzero when `data` is a private file mapping
+} SrcFile;
+
 typedef struct {
   Symbol *data;
   size_t len;
   size_t cap;
+  SrcFile **files; // source buffers the snippets point into
+  size_t nfiles;
+  size_t files_cap;
 } SymVec;
 
 typedef struct {
@@ -69,15 +116,105 @@ typedef struct {
   size_t len;
 } StrSet;
 
+typedef struct {
+  size_t *starts; // byte offset of every line start; starts[0] == 0
+  size_t count;   // number of lines
+  size_t len;     // length of the indexed buffer
+} LineIndex;
+
+typedef struct {
+  size_t open;  // offset of '{'
+  size_t close; // offset of the matching '}', or buffer length if unmatched
+  size_t next;  // index of the first pair after this block
+} BracePair;
+
+typedef struct {
+  BracePair *pairs; // in order of their '{'
+  size_t len;
+} BraceTable;
+
+#define ANNOTATION_LOOKBACK 6
+
+typedef struct {
+  int line;
+  int vis;          // VIS_PUBLIC | VIS_PRIVATE, or -1 when not tagged
+  char backend[32]; // "" when not tagged
+} Annotation;
+
+typedef struct {
+  Annotation *data; // sorted by line, at most one entry per line
+  size_t len;
+  size_t cap;
+} AnnotationVec;
+
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} Buf;
+
 static void die(const char *msg) {
   fprintf(stderr, "error: %s\n", msg);
   exit(1);
 }
 
+// Counters behind --stats. Allocation counts let a run on a large tree
+// confirm that scanning costs a fixed number of allocations per file, not
+// per line.
+typedef struct {
+  size_t allocs;      // malloc/calloc calls
+  size_t reallocs;    // realloc calls
+  size_t alloc_bytes; // bytes requested by both
+  size_t scan_allocs; // allocs + reallocs made by scan tasks
+  size_t files;       // files scanned
+  size_t files_mapped;
+  size_t files_cached; // files served from the scan cache
+  size_t files_rehashed; // of those, matched by content hash after a stat miss
+  size_t lines;
+  size_t bytes;
+  size_t symbols;
+} Stats;
+
+// Each thread counts into its own copy; stats_flush() folds it into the
+// process total when the thread is done.
+static _Thread_local Stats g_stats;
+static Stats g_stats_total;
+static pthread_mutex_t g_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void stats_flush(void) {
+  pthread_mutex_lock(&g_stats_lock);
+  size_t *dst = (size_t *)&g_stats_total;
+  const size_t *src = (const size_t *)&g_stats;
+  for (size_t i = 0; i < sizeof(Stats) / sizeof(size_t); i++)
+    dst[i] += src[i];
+  pthread_mutex_unlock(&g_stats_lock);
+  memset(&g_stats, 0, sizeof(g_stats));
+}
+
 static void *xmalloc(size_t n) {
   void *p = malloc(n);
   if (!p)
     die("out of memory");
+  g_stats.allocs++;
+  g_stats.alloc_bytes += n;
+  return p;
+}
+
+static void *xcalloc(size_t count, size_t size) {
+  void *p = calloc(count, size);
+  if (!p)
+    die("out of memory");
+  g_stats.allocs++;
+  g_stats.alloc_bytes += count * size;
+  return p;
+}
+
+static void *xrealloc(void *p, size_t n) {
+  p = realloc(p, n);
+  if (!p)
+    die("out of memory");
+  g_stats.reallocs++;
+  g_stats.alloc_bytes += n;
   return p;
 }
 
@@ -88,16 +225,47 @@ static char *xstrdup(const char *s) {
   return p;
 }
 
+static char *xstrndup(const char *s, size_t n) {
+  char *p = (char *)xmalloc(n + 1);
+  memcpy(p, s, n);
+  p[n] = 0;
+  return p;
+}
+
 static void vec_push(SymVec *v, Symbol s) {
   if (v->len == v->cap) {
     v->cap = v->cap ? v->cap * 2 : 128;
-    v->data = (Symbol *)realloc(v->data, v->cap * sizeof(Symbol));
-    if (!v->data)
-      die("out of memory");
+    v->data = (Symbol *)xrealloc(v->data, v->cap * sizeof(Symbol));
   }
   v->data[v->len++] = s;
 }
 
+static void vec_own_file(SymVec *v, SrcFile *sf) {
+  if (v->nfiles == v->files_cap) {
+    v->files_cap = v->files_cap ? v->files_cap * 2 : 64;
+    v->files =
+        (SrcFile **)xrealloc(v->files, v->files_cap * sizeof(SrcFile *));
+  }
+  v->files[v->nfiles++] = sf;
+}
+
+static char *buf_reserve(Buf *b, size_t n) {
+  if (b->len + n > b->cap) {
+    b->cap = b->cap ? b->cap : 256;
+    while (b->len + n > b->cap)
+      b->cap *= 2;
+    b->data = (char *)xrealloc(b->data, b->cap);
+  }
+  return b->data + b->len;
+}
+
+static void buf_put(Buf *b, const char *s, size_t n) {
+  memcpy(buf_reserve(b, n), s, n);
+  b->len += n;
+}
+
+static void buf_puts(Buf *b, const char *s) { buf_put(b, s, strlen(s)); }
+
 static const char *kind_str(SymKind k) {
   switch (k) {
   case SYM_FN_PROTO:
@@ -125,20 +293,6 @@ static bool has_c_ext(const char *name) {
          strcmp(dot, ".hpp") == 0;
 }
 
-static bool is_dir(const char *path) {
-  struct stat st;
-  if (stat(path, &st) != 0)
-    return false;
-  return S_ISDIR(st.st_mode);
-}
-
-static bool is_file(const char *path) {
-  struct stat st;
-  if (stat(path, &st) != 0)
-    return false;
-  return S_ISREG(st.st_mode);
-}
-
 static char *path_join(const char *a, const char *b) {
   size_t na = strlen(a), nb = strlen(b);
   bool need = (na > 0 && a[na - 1] != '/');
@@ -148,142 +302,566 @@ static char *path_join(const char *a, const char *b) {
   return p;
 }
 
-static int count_lines_upto(const char *s, size_t off) {
-  int line = 1;
-  for (size_t i = 0; i < off; i++)
-    if (s[i] == '\n')
-      line++;
-  return line;
+/* =======================
+   Structural character masks
+   ======================= */
+
+// Each 64-byte block of a buffer is classified into one bitmask per class
+// (bit i set when byte i of the block belongs to the class). Scanners walk
+// the set bits instead of testing every byte. The kernel is picked at
+// startup: AVX2 or SSE2 on x86, a scalar table lookup elsewhere.
+
+enum {
+  CLS_NEWLINE,   // '\n'
+  CLS_BRACE,     // '{' '}'
+  CLS_SEMI,      // ';'
+  CLS_QUOTE,     // '"' '\''
+  CLS_SLASH,     // '/', comment starts and block comment ends
+  CLS_HASH,      // '#'
+  CLS_BACKSLASH, // '\\'
+  CLS_COUNT
+};
+
+#define CLS(c) (1u << (c))
+
+typedef struct {
+  uint64_t bits[CLS_COUNT];
+} BlockMasks;
+
+static void classify_scalar(const unsigned char *p, BlockMasks *m) {
+  static unsigned char table[256];
+  if (!table['\n']) {
+    table['\n'] = CLS(CLS_NEWLINE);
+    table['{'] = table['}'] = CLS(CLS_BRACE);
+    table[';'] = CLS(CLS_SEMI);
+    table['"'] = table['\''] = CLS(CLS_QUOTE);
+    table['/'] = CLS(CLS_SLASH);
+    table['#'] = CLS(CLS_HASH);
+    table['\\'] = CLS(CLS_BACKSLASH);
+  }
+  memset(m, 0, sizeof(*m));
+  for (int i = 0; i < 64; i++) {
+    unsigned t = table[p[i]];
+    while (t) {
+      int c = __builtin_ctz(t);
+      m->bits[c] |= 1ull << i;
+      t &= t - 1;
+    }
+  }
+}
+
+#if defined(__SSE2__)
+static void classify_sse2(const unsigned char *p, BlockMasks *m) {
+  memset(m, 0, sizeof(*m));
+  for (int k = 0; k < 4; k++) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + 16 * k));
+#define EQ(ch) _mm_cmpeq_epi8(v, _mm_set1_epi8((char)(ch)))
+#define PUT(cls, x)                                                            \
+  m->bits[cls] |= (uint64_t)(uint16_t)_mm_movemask_epi8(x) << (16 * k)
+    PUT(CLS_NEWLINE, EQ('\n'));
+    PUT(CLS_BRACE, _mm_or_si128(EQ('{'), EQ('}')));
+    PUT(CLS_SEMI, EQ(';'));
+    PUT(CLS_QUOTE, _mm_or_si128(EQ('"'), EQ('\'')));
+    PUT(CLS_SLASH, EQ('/'));
+    PUT(CLS_HASH, EQ('#'));
+    PUT(CLS_BACKSLASH, EQ('\\'));
+#undef PUT
+#undef EQ
+  }
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+#define HAVE_AVX2_KERNEL 1
+__attribute__((target("avx2"))) static void
+classify_avx2(const unsigned char *p, BlockMasks *m) {
+  memset(m, 0, sizeof(*m));
+  for (int k = 0; k < 2; k++) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(p + 32 * k));
+#define EQ(ch) _mm256_cmpeq_epi8(v, _mm256_set1_epi8((char)(ch)))
+#define PUT(cls, x)                                                            \
+  m->bits[cls] |= (uint64_t)(uint32_t)_mm256_movemask_epi8(x) << (32 * k)
+    PUT(CLS_NEWLINE, EQ('\n'));
+    PUT(CLS_BRACE, _mm256_or_si256(EQ('{'), EQ('}')));
+    PUT(CLS_SEMI, EQ(';'));
+    PUT(CLS_QUOTE, _mm256_or_si256(EQ('"'), EQ('\'')));
+    PUT(CLS_SLASH, EQ('/'));
+    PUT(CLS_HASH, EQ('#'));
+    PUT(CLS_BACKSLASH, EQ('\\'));
+#undef PUT
+#undef EQ
+  }
+}
+#endif
+#endif
+
+static void (*classify_block)(const unsigned char *p,
+                              BlockMasks *m) = classify_scalar;
+
+static void simd_init(void) {
+#if defined(__SSE2__)
+  classify_block = classify_sse2;
+#if defined(HAVE_AVX2_KERNEL)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    classify_block = classify_avx2;
+#endif
+#endif
+  BlockMasks warm;
+  unsigned char zero[64] = {0};
+  classify_scalar(zero, &warm); // fill the scalar table before any threads
+}
+
+// Block-at-a-time cursor over a buffer; the last classified block is cached.
+typedef struct {
+  const char *s;
+  size_t n;
+  size_t base; // offset of the cached block, SIZE_MAX before the first
+  BlockMasks m;
+} MaskScan;
+
+static void mask_scan_init(MaskScan *ms, const char *s, size_t n) {
+  ms->s = s;
+  ms->n = n;
+  ms->base = SIZE_MAX;
+}
+
+static const BlockMasks *mask_block(MaskScan *ms, size_t i) {
+  size_t base = i & ~(size_t)63;
+  if (base != ms->base) {
+    if (base + 64 <= ms->n) {
+      classify_block((const unsigned char *)ms->s + base, &ms->m);
+    } else {
+      unsigned char tail[64] = {0}; // NUL matches no class
+      memcpy(tail, ms->s + base, ms->n - base);
+      classify_block(tail, &ms->m);
+    }
+    ms->base = base;
+  }
+  return &ms->m;
+}
+
+// Offset of the first byte at or after `i` in any of `classes` (a CLS() set);
+// the buffer length if there is none.
+static size_t mask_next(MaskScan *ms, size_t i, unsigned classes) {
+  while (i < ms->n) {
+    const BlockMasks *m = mask_block(ms, i);
+    uint64_t sel = 0;
+    for (int c = 0; c < CLS_COUNT; c++)
+      if (classes & CLS(c))
+        sel |= m->bits[c];
+    sel &= ~0ull << (i - ms->base);
+    if (sel)
+      return ms->base + (size_t)__builtin_ctzll(sel);
+    i = ms->base + 64;
+  }
+  return ms->n;
+}
+
+/* =======================
+   Line index
+   ======================= */
+
+static void line_index_build(LineIndex *li, const char *s, size_t len) {
+  size_t cap = 1024;
+  li->starts = (size_t *)xmalloc(cap * sizeof(size_t));
+  li->starts[0] = 0;
+  li->count = 1;
+  li->len = len;
+  MaskScan ms;
+  mask_scan_init(&ms, s, len);
+  for (size_t base = 0; base < len; base += 64) {
+    uint64_t nl = mask_block(&ms, base)->bits[CLS_NEWLINE];
+    for (; nl; nl &= nl - 1) {
+      if (li->count == cap) {
+        cap *= 2;
+        li->starts = (size_t *)xrealloc(li->starts, cap * sizeof(size_t));
+      }
+      li->starts[li->count++] = base + (size_t)__builtin_ctzll(nl) + 1;
+    }
+  }
+}
+
+static void line_index_free(LineIndex *li) {
+  free(li->starts);
+  li->starts = NULL;
+  li->count = li->len = 0;
+}
+
+// 1-based line containing byte offset `off` (binary search).
+static int line_index_line_of(const LineIndex *li, size_t off) {
+  size_t lo = 0, hi = li->count;
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (li->starts[mid] <= off)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return (int)lo + 1;
+}
+
+// Byte offset where 1-based line `line` starts (buffer end if past EOF).
+static size_t line_index_start(const LineIndex *li, int line) {
+  if (line < 1)
+    return 0;
+  if ((size_t)line > li->count)
+    return li->len;
+  return li->starts[line - 1];
+}
+
+static bool json_needs_escape(unsigned char c) {
+  return c < 0x20 || c == '"' || c == '\\';
+}
+
+// First byte in [p, end) that needs escaping, or `end`. With SSE2 it tests
+// 16 bytes at a time.
+static const unsigned char *json_safe_run(const unsigned char *p,
+                                          const unsigned char *end) {
+#if defined(__SSE2__)
+  const __m128i ctl = _mm_set1_epi8(0x1f);
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i bslash = _mm_set1_epi8('\\');
+  for (; end - p >= 16; p += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i esc = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, ctl), v),
+                               _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                                            _mm_cmpeq_epi8(v, bslash)));
+    unsigned m = (unsigned)_mm_movemask_epi8(esc);
+    if (m)
+      return p + __builtin_ctz(m);
+  }
+#endif
+  while (p < end && !json_needs_escape(*p))
+    p++;
+  return p;
 }
 
-static void json_escape_write(FILE *f, const char *s) {
-  fputc('"', f);
-  for (const unsigned char *p = (const unsigned char *)s; *p; p++) {
-    unsigned char c = *p;
+// Append `s` as a JSON string. Runs of bytes that need no escaping are
+// copied in bulk; only the bytes that do go through the switch.
+static void json_escape_buf(Buf *b, const char *s) {
+  buf_put(b, "\"", 1);
+  const unsigned char *p = (const unsigned char *)s;
+  const unsigned char *end = p + strlen(s);
+  for (;;) {
+    const unsigned char *run = p;
+    p = json_safe_run(p, end);
+    buf_put(b, (const char *)run, (size_t)(p - run));
+    if (p == end)
+      break;
+    unsigned char c = *p++;
     switch (c) {
     case '\\':
-      fputs("\\\\", f);
+      buf_put(b, "\\\\", 2);
       break;
     case '"':
-      fputs("\\\"", f);
+      buf_put(b, "\\\"", 2);
       break;
     case '\n':
-      fputs("\\n", f);
+      buf_put(b, "\\n", 2);
       break;
     case '\r':
-      fputs("\\r", f);
+      buf_put(b, "\\r", 2);
       break;
     case '\t':
-      fputs("\\t", f);
+      buf_put(b, "\\t", 2);
       break;
     default:
-      if (c < 0x20)
-        fprintf(f, "\\u%04x", (unsigned)c);
-      else
-        fputc(c, f);
+      snprintf(buf_reserve(b, 7), 7, "\\u%04x", (unsigned)c);
+      b->len += 6;
+    }
+  }
+  buf_put(b, "\"", 1);
+}
+
+/* =======================
+   File ingestion
+   ======================= */
+
+// Files at least this large are mapped; smaller ones are cheaper to read().
+#define MMAP_MIN_SIZE (64 * 1024)
+
+// Set by serve, whose symbols outlive the scan: a mapped file truncated in
+// the meantime faults (SIGBUS) when touched, and in-place writes show through
+// pages not yet copied, so resident files are always read().
+static bool g_no_mmap;
+
+// Read everything from `fd` into a NUL-terminated buffer. `hint` is the
+// expected size (0 for pipes and other unsized inputs).
+static char *read_fd(int fd, size_t hint, size_t *out_len) {
+  size_t cap = hint ? hint + 1 : 64 * 1024;
+  size_t len = 0;
+  char *buf = (char *)xmalloc(cap);
+  for (;;) {
+    if (len + 1 >= cap) {
+      cap *= 2;
+      buf = (char *)xrealloc(buf, cap);
+    }
+    ssize_t got = read(fd, buf + len, cap - len - 1);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got < 0) {
+      free(buf);
+      return NULL;
+    }
+    if (got == 0)
+      break;
+    len += (size_t)got;
+  }
+  buf[len] = '\0';
+  if (out_len)
+    *out_len = len;
+  return buf;
+}
+
+// Write all of `len` bytes; false on error.
+static bool write_full(int fd, const void *data, size_t len) {
+  const char *p = (const char *)data;
+  while (len > 0) {
+    ssize_t w = write(fd, p, len);
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
     }
+    p += w;
+    len -= (size_t)w;
   }
-  fputc('"', f);
+  return true;
+}
+
+static size_t fd_size_hint(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    return (size_t)st.st_size;
+  return 0;
 }
 
 static char *read_entire_file(const char *path, size_t *out_len) {
-  FILE *fp = fopen(path, "rb");
-  if (!fp)
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
     return NULL;
-  if (fseek(fp, 0, SEEK_END) != 0) {
-    fclose(fp);
+  char *buf = read_fd(fd, fd_size_hint(fd), out_len);
+  close(fd);
+  return buf;
+}
+
+// Load a source file for scanning. Large regular files are mapped
+// MAP_PRIVATE, so blanking comments in place copies only the pages it
+// touches; small files, pipes, anything mmap refuses and everything under
+// g_no_mmap go through read(). The buffer is not NUL-terminated in the
+// mapped case.
+static SrcFile *src_load_at(int dirfd, const char *name) {
+  int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
     return NULL;
+  SrcFile *sf = (SrcFile *)xmalloc(sizeof(SrcFile));
+  sf->map_len = 0;
+
+  size_t size = fd_size_hint(fd);
+  if (size >= MMAP_MIN_SIZE && !g_no_mmap) {
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED) {
+      posix_madvise(p, size, POSIX_MADV_SEQUENTIAL);
+      sf->data = (char *)p;
+      sf->len = sf->map_len = size;
+      close(fd);
+      return sf;
+    }
   }
-  long n = ftell(fp);
-  if (n < 0) {
-    fclose(fp);
+
+  sf->data = read_fd(fd, size, &sf->len);
+  close(fd);
+  if (!sf->data) {
+    free(sf);
     return NULL;
   }
-  rewind(fp);
-  char *buf = (char *)xmalloc((size_t)n + 1);
-  size_t got = fread(buf, 1, (size_t)n, fp);
-  fclose(fp);
-  buf[got] = '\0';
-  if (out_len)
-    *out_len = got;
-  return buf;
+  return sf;
 }
 
-static char *strip_comments(const char *src) {
-  // naive comment stripper; OK for most codebases
-  size_t n = strlen(src);
-  char *out = (char *)xmalloc(n + 1);
-  size_t i = 0, j = 0;
-  while (i < n) {
-    if (src[i] == '/' && src[i + 1] == '/') {
-      i += 2;
-      while (i < n && src[i] != '\n')
-        i++;
-    } else if (src[i] == '/' && src[i + 1] == '*') {
-      i += 2;
-      while (i + 1 < n && !(src[i] == '*' && src[i + 1] == '/'))
-        i++;
-      if (i + 1 < n)
-        i += 2;
+static void src_free(SrcFile *sf) {
+  if (!sf)
+    return;
+  if (sf->map_len)
+    munmap(sf->data, sf->map_len);
+  else
+    free(sf->data);
+  free(sf);
+}
+
+// Blank comments in place with spaces, keeping every newline so byte offsets
+// and line numbers are unchanged. String and char literals are skipped so
+// "//" or "/*" inside them is left alone.
+static void strip_comments(char *s, size_t n) {
+  MaskScan ms;
+  mask_scan_init(&ms, s, n);
+  size_t i = 0;
+  while ((i = mask_next(&ms, i, CLS(CLS_QUOTE) | CLS(CLS_SLASH))) < n) {
+    char c = s[i];
+    if (c == '"' || c == '\'') {
+      i++;
+      for (;;) {
+        i = mask_next(&ms, i,
+                      CLS(CLS_QUOTE) | CLS(CLS_BACKSLASH) | CLS(CLS_NEWLINE));
+        if (i >= n || s[i] == '\n')
+          break;
+        if (s[i] == '\\') {
+          i += 2;
+        } else if (s[i++] == c) {
+          break;
+        }
+      }
+    } else if (i + 1 < n && s[i + 1] == '/') {
+      // a trailing backslash continues the comment onto the next line
+      for (;;) {
+        size_t j = mask_next(&ms, i, CLS(CLS_NEWLINE));
+        bool cont = j < n && ((j >= i + 1 && s[j - 1] == '\\') ||
+                              (j >= i + 2 && s[j - 1] == '\r' &&
+                               s[j - 2] == '\\'));
+        memset(s + i, ' ', j - i);
+        i = j;
+        if (!cont)
+          break;
+        i++; // keep the newline
+      }
+    } else if (i + 1 < n && s[i + 1] == '*') {
+      size_t j = i + 2;
+      while ((j = mask_next(&ms, j, CLS(CLS_SLASH))) < n &&
+             !(j >= i + 3 && s[j - 1] == '*'))
+        j++;
+      size_t end = j < n ? j + 1 : n;
+      for (; i < end; i++)
+        if (s[i] != '\n')
+          s[i] = ' ';
     } else {
-      out[j++] = src[i++];
+      i++;
     }
   }
-  out[j] = '\0';
-  return out;
 }
 
-static size_t extract_brace_block(const char *s, size_t start,
-                                  size_t *end_out) {
-  size_t i = start;
-  while (s[i] && s[i] != '{')
+// End of the preprocessor directive starting at `off` (its last newline is
+// left for the lexer), following backslash continuations.
+static size_t directive_end(const char *s, size_t off, size_t end) {
+  size_t i = off;
+  while (i < end && s[i] != '\n') {
+    if (s[i] == '\\' && i + 1 < end && s[i + 1] == '\n')
+      i++;
     i++;
-  if (!s[i])
-    return (size_t)-1;
-  int depth = 0;
-  size_t j = i;
-  for (; s[j]; j++) {
-    if (s[j] == '{')
-      depth++;
-    else if (s[j] == '}') {
-      depth--;
-      if (depth == 0) {
-        if (end_out)
-          *end_out = j + 1;
-        return i;
+  }
+  return i;
+}
+
+// Match every brace in one pass, skipping string/char literals and
+// preprocessor directives. Pairs are stored in order of their '{'; an
+// unmatched '{' closes at the buffer end and a stray '}' is ignored.
+static void brace_table_build(BraceTable *bt, const char *s, size_t n) {
+  size_t cap = 64, depth = 0, stack_cap = 64;
+  size_t *stack = (size_t *)xmalloc(stack_cap * sizeof(size_t));
+  bt->pairs = (BracePair *)xmalloc(cap * sizeof(BracePair));
+  bt->len = 0;
+  MaskScan ms;
+  mask_scan_init(&ms, s, n);
+  const unsigned structural = CLS(CLS_BRACE) | CLS(CLS_QUOTE) | CLS(CLS_HASH);
+  for (size_t i = 0; (i = mask_next(&ms, i, structural)) < n; i++) {
+    char c = s[i];
+    if (c == '#') {
+      size_t k = i;
+      while (k > 0 && (s[k - 1] == ' ' || s[k - 1] == '\t' ||
+                       s[k - 1] == '\r' || s[k - 1] == '\f' ||
+                       s[k - 1] == '\v'))
+        k--;
+      if (k == 0 || s[k - 1] == '\n')
+        i = directive_end(s, i, n) - 1;
+    } else if (c == '"' || c == '\'') {
+      for (i++;; i += 2) {
+        i = mask_next(&ms, i,
+                      CLS(CLS_QUOTE) | CLS(CLS_BACKSLASH) | CLS(CLS_NEWLINE));
+        if (i >= n || s[i] == '\n' || s[i] == c)
+          break;
+        if (s[i] != '\\')
+          i--; // the other quote kind, step over it
+      }
+    } else if (c == '{') {
+      if (bt->len == cap) {
+        cap *= 2;
+        bt->pairs = (BracePair *)xrealloc(bt->pairs, cap * sizeof(BracePair));
       }
+      if (depth == stack_cap) {
+        stack_cap *= 2;
+        stack = (size_t *)xrealloc(stack, stack_cap * sizeof(size_t));
+      }
+      BracePair bp = {i, n, 0};
+      stack[depth++] = bt->len;
+      bt->pairs[bt->len++] = bp;
+    } else if (c == '}' && depth > 0) {
+      size_t k = stack[--depth];
+      bt->pairs[k].close = i;
+      bt->pairs[k].next = bt->len;
     }
   }
-  if (end_out)
-    *end_out = j;
-  return i;
+  while (depth > 0) {
+    size_t k = stack[--depth];
+    bt->pairs[k].next = bt->len;
+  }
+  free(stack);
 }
 
-static char *slice_lines(const char *raw, int ls, int le) {
-  int line = 1;
-  const char *p = raw;
-  const char *end = raw + strlen(raw);
+static void brace_table_free(BraceTable *bt) {
+  free(bt->pairs);
+  bt->pairs = NULL;
+  bt->len = 0;
+}
 
-  while (p < end && line < ls) {
-    if (*p++ == '\n')
-      line++;
+// Cursor for lookups starting at `off`: the first pair opening at or after it.
+static size_t brace_table_seek(const BraceTable *bt, size_t off) {
+  size_t lo = 0, hi = bt->len;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (bt->pairs[mid].open < off)
+      lo = mid + 1;
+    else
+      hi = mid;
   }
-  const char *start = p;
+  return lo;
+}
 
-  while (p < end && line <= le) {
-    if (*p++ == '\n')
-      line++;
-  }
+// Offset just past the '}' matching the '{' at `open` (buffer end if it is
+// unmatched). Lookups must come in increasing offset order; *cursor carries
+// the position between calls and hops over whole nested blocks, so a full
+// scan costs O(1) amortized per lookup.
+static size_t brace_table_close(const BraceTable *bt, size_t *cursor,
+                                size_t open, size_t n) {
+  size_t c = *cursor;
+  while (c < bt->len && bt->pairs[c].open < open)
+    c = bt->pairs[c].close < open ? bt->pairs[c].next : c + 1;
+  *cursor = c;
+  if (c == bt->len || bt->pairs[c].open != open)
+    return n;
+  return bt->pairs[c].close < n ? bt->pairs[c].close + 1 : n;
+}
 
-  size_t n = (size_t)(p - start);
+// Copy a run of whole lines. Comments have been blanked to spaces, so
+// trailing blanks are dropped from every line.
+static char *slice_lines(const char *text, size_t n) {
   char *out = (char *)xmalloc(n + 1);
-  memcpy(out, start, n);
-  out[n] = '\0';
-  while (n > 0 && (out[n - 1] == '\n' || out[n - 1] == '\r'))
-    out[--n] = '\0';
+  size_t j = 0;
+  for (size_t i = 0; i < n; i++) {
+    char c = text[i];
+    if (c == '\n' || c == '\r')
+      while (j > 0 && (out[j - 1] == ' ' || out[j - 1] == '\t'))
+        j--;
+    out[j++] = c;
+  }
+  while (j > 0 && isspace((unsigned char)out[j - 1]))
+    j--;
+  out[j] = '\0';
   return out;
 }
 
+// Materialize a symbol's snippet; the caller frees it.
+static char *sym_snippet(const Symbol *s) {
+  return slice_lines(s->src->data + s->snippet_off, s->snippet_len);
+}
+
 static bool path_contains(const char *path, const char *needle) {
   return strstr(path, needle) != NULL;
 }
@@ -308,159 +886,115 @@ static const char *default_backend_for_path(const char *relpath) {
   return "core";
 }
 
-static Visibility annotation_visibility(const char *raw, int line_start) {
-  // Look back up to 6 lines for "@api public/private"
-  int lookback = 6;
-  int target = line_start;
-  int cur = 1;
-
-  // We'll scan raw line-by-line until target; store last few lines in a ring
-  const char *p = raw;
-  const char *end = raw + strlen(raw);
-  const char *ring[6] = {0};
-  int ringi = 0;
+/* =======================
+   Annotations (@api / @backend)
+   ======================= */
 
-  while (p < end) {
-    const char *ls = p;
-    while (p < end && *p != '\n')
-      p++;
-    size_t n = (size_t)(p - ls);
-
-    char *line = (char *)xmalloc(n + 1);
-    memcpy(line, ls, n);
-    line[n] = 0;
-
-    ring[ringi % lookback] = line;
-    ringi++;
-
-    if (cur == target) {
-      // check ring buffer excluding current line
-      int start = ringi - 1 - lookback;
-      if (start < 0)
-        start = 0;
-      for (int i = ringi - 2; i >= start; i--) {
-        const char *s = ring[i % lookback];
-        if (!s)
-          continue;
-        if (strstr(s, "@api public")) {
-          // free ring
-          for (int k = 0; k < lookback; k++)
-            if (ring[k])
-              free((void *)ring[k]);
-          return VIS_PUBLIC;
-        }
-        if (strstr(s, "@api private")) {
-          for (int k = 0; k < lookback; k++)
-            if (ring[k])
-              free((void *)ring[k]);
-          return VIS_PRIVATE;
-        }
-      }
-      for (int k = 0; k < lookback; k++)
-        if (ring[k])
-          free((void *)ring[k]);
-      return (Visibility)-1; // no annotation
+// One pre-pass per file records every annotated line; symbol lookups are then
+// a binary search over this table with no allocation.
+static void annotations_scan(AnnotationVec *av, const char *raw, size_t len,
+                             const LineIndex *li) {
+  av->data = NULL;
+  av->len = av->cap = 0;
+  const char *end = raw + len;
+  for (const char *p = raw; (p = memchr(p, '@', (size_t)(end - p))) != NULL;
+       p++) {
+    int vis = -1;
+    char backend[32] = {0};
+    size_t rest = (size_t)(end - p);
+
+    if (rest >= 11 && memcmp(p, "@api public", 11) == 0) {
+      vis = VIS_PUBLIC;
+    } else if (rest >= 12 && memcmp(p, "@api private", 12) == 0) {
+      vis = VIS_PRIVATE;
+    } else if (rest >= 8 && memcmp(p, "@backend", 8) == 0) {
+      const char *t = p + 8;
+      while (t < end && *t != '\n' && isspace((unsigned char)*t))
+        t++;
+      size_t j = 0;
+      while (t < end && (isalnum((unsigned char)*t) || *t == '_' ||
+                         *t == '-') &&
+             j < sizeof(backend) - 1)
+        backend[j++] = *t++;
     }
+    if (vis == -1 && !backend[0])
+      continue;
 
-    if (p < end && *p == '\n')
-      p++;
-    cur++;
-    // keep only last lookback stored; free older overwritten
-    if (ringi > lookback) {
-      int idx = (ringi - lookback - 1) % lookback;
-      if (ring[idx]) {
-        free((void *)ring[idx]);
-        ring[idx] = 0;
+    int line = line_index_line_of(li, (size_t)(p - raw));
+    if (!av->len || av->data[av->len - 1].line != line) {
+      if (av->len == av->cap) {
+        av->cap = av->cap ? av->cap * 2 : 16;
+        av->data =
+            (Annotation *)xrealloc(av->data, av->cap * sizeof(Annotation));
       }
+      Annotation a = {line, -1, {0}};
+      av->data[av->len++] = a;
     }
+    // Per line, "@api public" beats "@api private" and the first @backend
+    // tag wins.
+    Annotation *a = &av->data[av->len - 1];
+    if (vis == VIS_PUBLIC || (vis == VIS_PRIVATE && a->vis == -1))
+      a->vis = vis;
+    if (backend[0] && !a->backend[0])
+      memcpy(a->backend, backend, sizeof(backend));
   }
-
-  for (int k = 0; k < lookback; k++)
-    if (ring[k])
-      free((void *)ring[k]);
-  return (Visibility)-1;
 }
 
-static const char *annotation_backend(const char *raw, int line_start) {
-  // Look back up to 6 lines for "@backend X"
-  int lookback = 6;
-  int target = line_start;
-  int cur = 1;
-
-  const char *p = raw;
-  const char *end = raw + strlen(raw);
-  const char *ring[6] = {0};
-  int ringi = 0;
-
-  while (p < end) {
-    const char *ls = p;
-    while (p < end && *p != '\n') p++;
-    size_t n = (size_t)(p - ls);
-
-    char *line = (char *)xmalloc(n + 1);
-    memcpy(line, ls, n);
-    line[n] = 0;
-
-    ring[ringi % lookback] = line;
-    ringi++;
-
-    if (cur == target) {
-      int start = ringi - 1 - lookback;
-      if (start < 0) start = 0;
-      for (int i = ringi - 2; i >= start; i--) {
-        const char *s = ring[i % lookback];
-        if (!s) continue;
-
-        const char *tag = strstr(s, "@backend");
-        if (tag) {
-          tag += strlen("@backend");
-          while (*tag && isspace((unsigned char)*tag)) tag++;
-
-          // read token
-          char buf[32] = {0};
-          int j = 0;
-          while (*tag && (isalnum((unsigned char)*tag) || *tag == '_' || *tag == '-') && j < 31) {
-            buf[j++] = *tag++;
-          }
-          buf[j] = 0;
+static void annotations_free(AnnotationVec *av) {
+  free(av->data);
+  av->data = NULL;
+  av->len = av->cap = 0;
+}
 
-          for (int k = 0; k < lookback; k++) if (ring[k]) free((void *)ring[k]);
-          if (buf[0]) return xstrdup(buf); // caller must free
-        }
-      }
-      for (int k = 0; k < lookback; k++) if (ring[k]) free((void *)ring[k]);
-      return NULL;
-    }
+// Index one past the last annotation at or before `line`.
+static size_t annotations_upto(const AnnotationVec *av, int line) {
+  size_t lo = 0, hi = av->len;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (av->data[mid].line <= line)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
 
-    if (p < end && *p == '\n') p++;
-    cur++;
-    if (ringi > lookback) {
-      int idx = (ringi - lookback - 1) % lookback;
-      if (ring[idx]) { free((void *)ring[idx]); ring[idx] = 0; }
-    }
+static Visibility annotation_visibility(const AnnotationVec *av,
+                                        int line_start) {
+  // Nearest "@api public/private" in the lookback before the symbol line
+  for (size_t i = annotations_upto(av, line_start - 1); i > 0; i--) {
+    const Annotation *a = &av->data[i - 1];
+    if (a->line < line_start - ANNOTATION_LOOKBACK)
+      break;
+    if (a->vis != -1)
+      return (Visibility)a->vis;
   }
+  return (Visibility)-1; // no annotation
+}
 
-  for (int k = 0; k < lookback; k++) if (ring[k]) free((void *)ring[k]);
+static const char *annotation_backend(const AnnotationVec *av,
+                                      int line_start) {
+  // Nearest "@backend X" in the lookback before the symbol line
+  for (size_t i = annotations_upto(av, line_start - 1); i > 0; i--) {
+    const Annotation *a = &av->data[i - 1];
+    if (a->line < line_start - ANNOTATION_LOOKBACK)
+      break;
+    if (a->backend[0])
+      return a->backend;
+  }
   return NULL;
 }
 
-static char *normalize_first_sigline(const char *snippet) {
-  // Return normalized first line (collapse whitespace), for function sig
-  // extraction
-  const char *nl = strchr(snippet, '\n');
-  size_t n = nl ? (size_t)(nl - snippet) : strlen(snippet);
-  char *tmp = (char *)xmalloc(n + 1);
-  memcpy(tmp, snippet, n);
-  tmp[n] = 0;
-
-  // collapse whitespace
+static char *normalize_sigline(const char *sig, size_t n) {
+  // Collapse the signature span [sig, sig + n) onto one line for function
+  // sig extraction; prototypes may be wrapped over several lines.
   char *out = (char *)xmalloc(n + 1);
   size_t j = 0;
   bool inws = false;
   for (size_t i = 0; i < n; i++) {
-    unsigned char c = (unsigned char)tmp[i];
+    unsigned char c = (unsigned char)sig[i];
     if (isspace(c)) {
-      if (!inws)
+      if (!inws && j > 0)
         out[j++] = ' ';
       inws = true;
     } else {
@@ -478,7 +1012,6 @@ static char *normalize_first_sigline(const char *snippet) {
   while (j > 0 && isspace((unsigned char)out[j - 1]))
     out[--j] = 0;
 
-  free(tmp);
   return out;
 }
 
@@ -498,9 +1031,7 @@ static uint64_t fnv1a(const char *s) {
 static void set_init(StrSet *st, size_t cap_pow2) {
   st->cap = cap_pow2;
   st->len = 0;
-  st->keys = (char **)calloc(st->cap, sizeof(char *));
-  if (!st->keys)
-    die("out of memory");
+  st->keys = (char **)xcalloc(st->cap, sizeof(char *));
 }
 
 static void set_free(StrSet *st) {
@@ -558,642 +1089,2827 @@ static void set_grow(StrSet *st) {
 }
 
 /* =======================
-   Scanning
+   String interning
    ======================= */
 
-static void scan_file(const char *path, const char *root, SymVec *out_syms,
-                      regex_t *re_fn, regex_t *re_typedef_struct,
-                      regex_t *re_struct) {
+// Every name, path and backend string is stored once, in a table shared by
+// all scanner threads, and symbols refer to it by a 32-bit id. The table is
+// split into shards by hash, each behind its own lock, so threads interning
+// different strings rarely meet. Ids are (index in shard << INTERN_SHARD_BITS
+// | shard); strings live in per-shard arenas and never move, so str_of()
+// takes no lock.
 
-  size_t raw_len = 0;
-  char *raw = read_entire_file(path, &raw_len);
-  if (!raw)
-    return;
+#define INTERN_SHARD_BITS 6
+#define INTERN_SHARDS (1u << INTERN_SHARD_BITS)
+#define INTERN_PAGE 4096   // string pointers per page
+#define INTERN_PAGES 4096  // pages per shard
+#define INTERN_ARENA (64 * 1024)
 
-  char *text = strip_comments(raw);
+typedef struct {
+  uint32_t hash;
+  StrId id; // STR_NONE when the slot is empty
+} InternSlot;
 
-  // relative path
-  const char *rel = path;
-  size_t root_len = strlen(root);
-  if (strncmp(path, root, root_len) == 0) {
-    rel = path + root_len;
-    if (*rel == '/')
-      rel++;
+typedef struct {
+  pthread_mutex_t lock;
+  InternSlot *slots;
+  size_t cap, len;
+  const char **pages[INTERN_PAGES];
+  char *arena;
+  size_t arena_left;
+} InternShard;
+
+static InternShard g_intern[INTERN_SHARDS];
+static StrId g_core_id; // "core", the backend of untagged symbols
+// Set once scanning is over and before readers start; lookups then skip
+// the shard locks and interning new strings is a bug.
+static bool g_intern_frozen;
+
+static uint32_t hash_bytes(const char *s, size_t n) {
+  uint64_t h = 1469598103934665603ull;
+  for (size_t i = 0; i < n; i++) {
+    h ^= (unsigned char)s[i];
+    h *= 1099511628211ull;
   }
+  return (uint32_t)(h ^ (h >> 32));
+}
 
-  const char *file_default_backend = default_backend_for_path(rel);
-
-  Visibility file_default_vis = default_visibility_for_path(rel);
+static const char *str_of(StrId id) {
+  const InternShard *sh = &g_intern[id & (INTERN_SHARDS - 1)];
+  size_t i = id >> INTERN_SHARD_BITS;
+  return sh->pages[i / INTERN_PAGE][i % INTERN_PAGE];
+}
 
-  // --- typedef struct ---
-  for (size_t pos = 0; text[pos];) {
-    regmatch_t m[2];
-    if (regexec(re_typedef_struct, text + pos, 2, m, 0) != 0)
-      break;
+// Slot holding `s` in `sh`, or the empty slot where it would go. Caller
+// holds the shard lock.
+static InternSlot *intern_probe(InternShard *sh, const char *s, size_t n,
+                                uint32_t h) {
+  size_t mask = sh->cap - 1;
+  for (size_t i = (h >> INTERN_SHARD_BITS) & mask;; i = (i + 1) & mask) {
+    InternSlot *sl = &sh->slots[i];
+    if (sl->id == STR_NONE)
+      return sl;
+    if (sl->hash == h) {
+      const char *k = str_of(sl->id);
+      if (strncmp(k, s, n) == 0 && k[n] == 0)
+        return sl;
+    }
+  }
+}
 
-    size_t start = pos + (size_t)m[0].rm_so;
-    size_t end_block = 0;
-    size_t brace_i = extract_brace_block(text, start, &end_block);
-    if (brace_i == (size_t)-1) {
-      pos = start + 1;
+static void intern_grow(InternShard *sh) {
+  InternSlot *old = sh->slots;
+  size_t old_cap = sh->cap;
+  sh->cap = old_cap ? old_cap * 2 : 256;
+  sh->slots = (InternSlot *)xmalloc(sh->cap * sizeof(InternSlot));
+  for (size_t i = 0; i < sh->cap; i++)
+    sh->slots[i].id = STR_NONE;
+  size_t mask = sh->cap - 1;
+  for (size_t i = 0; i < old_cap; i++) {
+    if (old[i].id == STR_NONE)
       continue;
-    }
+    size_t j = (old[i].hash >> INTERN_SHARD_BITS) & mask;
+    while (sh->slots[j].id != STR_NONE)
+      j = (j + 1) & mask;
+    sh->slots[j] = old[i];
+  }
+  free(old);
+}
 
-    const char *tail = text + end_block;
-    const char *semi = strchr(tail, ';');
-
-    char namebuf[256] = {0};
-    bool got = false;
-    if (semi) {
-      const char *r = semi;
-      while (r > tail && !(isalnum((unsigned char)r[-1]) || r[-1] == '_'))
-        r--;
-      const char *end_id = r;
-      while (r > tail && (isalnum((unsigned char)r[-1]) || r[-1] == '_'))
-        r--;
-      const char *start_id = r;
-      size_t n = (size_t)(end_id - start_id);
-      if (n > 0 && n < sizeof(namebuf)) {
-        memcpy(namebuf, start_id, n);
-        namebuf[n] = 0;
-        got = true;
-      }
+// Id of the string s[0, n), adding it on first sight.
+static StrId intern(const char *s, size_t n) {
+  if (g_intern_frozen)
+    die("string interned after the table was frozen");
+  uint32_t h = hash_bytes(s, n);
+  InternShard *sh = &g_intern[h & (INTERN_SHARDS - 1)];
+  pthread_mutex_lock(&sh->lock);
+  if ((sh->len + 1) * 2 > sh->cap)
+    intern_grow(sh);
+  InternSlot *sl = intern_probe(sh, s, n, h);
+  if (sl->id == STR_NONE) {
+    size_t i = sh->len++;
+    if (i / INTERN_PAGE >= INTERN_PAGES)
+      die("too many distinct strings");
+    if (n + 1 > sh->arena_left) {
+      size_t sz = n + 1 > INTERN_ARENA ? n + 1 : INTERN_ARENA;
+      sh->arena = (char *)xmalloc(sz);
+      sh->arena_left = sz;
     }
-    if (!got)
-      snprintf(namebuf, sizeof(namebuf), "ANON_TYPEDEF_STRUCT");
-
-    int ls = count_lines_upto(text, start);
-    size_t end_off = end_block;
-    if (semi)
-      end_off = end_block + (size_t)(semi - tail) + 1;
-    int le = count_lines_upto(text, end_off);
+    char *k = sh->arena;
+    memcpy(k, s, n);
+    k[n] = 0;
+    sh->arena += n + 1;
+    sh->arena_left -= n + 1;
+    if (!sh->pages[i / INTERN_PAGE])
+      sh->pages[i / INTERN_PAGE] =
+          (const char **)xmalloc(INTERN_PAGE * sizeof(char *));
+    sh->pages[i / INTERN_PAGE][i % INTERN_PAGE] = k;
+    sl->hash = h;
+    sl->id = (StrId)(i << INTERN_SHARD_BITS | (h & (INTERN_SHARDS - 1)));
+  }
+  StrId id = sl->id;
+  pthread_mutex_unlock(&sh->lock);
+  return id;
+}
 
-    Visibility vis = file_default_vis;
-    Visibility ann = annotation_visibility(raw, ls);
-    if ((int)ann != -1)
-      vis = ann;
+static StrId intern_str(const char *s) { return intern(s, strlen(s)); }
+
+// Id of s[0, n) if it was ever interned, else STR_NONE.
+static StrId intern_find(const char *s, size_t n) {
+  uint32_t h = hash_bytes(s, n);
+  InternShard *sh = &g_intern[h & (INTERN_SHARDS - 1)];
+  if (g_intern_frozen)
+    return sh->cap ? intern_probe(sh, s, n, h)->id : STR_NONE;
+  pthread_mutex_lock(&sh->lock);
+  StrId id = sh->cap ? intern_probe(sh, s, n, h)->id : STR_NONE;
+  pthread_mutex_unlock(&sh->lock);
+  return id;
+}
 
-    Symbol sym = {0};
-    sym.kind = SYM_TYPEDEF_STRUCT;
-    sym.vis = vis;
-    sym.name = xstrdup(namebuf);
-    sym.file = xstrdup(rel);
-    sym.line_start = ls;
-    sym.line_end = le;
-    const char *bk = file_default_backend;
-    char *annb = (char *)annotation_backend(raw, ls);
-    if (annb) {
-      bk = annb;
-    } // annb is heap
-
-    sym.backend = xstrdup(bk);
-
-    if (annb)
-      free(annb);
-
-    sym.snippet = slice_lines(raw, ls, le);
-    sym.sigline = NULL;
-    vec_push(out_syms, sym);
-
-    pos = end_off;
-  }
-
-  // --- struct ---
-  for (size_t pos = 0; text[pos];) {
-    regmatch_t m[2];
-    if (regexec(re_struct, text + pos, 2, m, 0) != 0)
-      break;
+// Call with no other thread running.
+static void intern_freeze(void) { g_intern_frozen = true; }
+
+// One past the largest id handed out so far.
+static size_t intern_id_bound(void) {
+  size_t most = 0;
+  for (unsigned i = 0; i < INTERN_SHARDS; i++) {
+    pthread_mutex_lock(&g_intern[i].lock);
+    if (g_intern[i].len > most)
+      most = g_intern[i].len;
+    pthread_mutex_unlock(&g_intern[i].lock);
+  }
+  return most << INTERN_SHARD_BITS;
+}
 
-    size_t start = pos + (size_t)m[0].rm_so;
-    size_t tag_so = pos + (size_t)m[1].rm_so;
-    size_t tag_eo = pos + (size_t)m[1].rm_eo;
+static void intern_init(void) {
+  for (unsigned i = 0; i < INTERN_SHARDS; i++)
+    pthread_mutex_init(&g_intern[i].lock, NULL);
+  g_core_id = intern_str("core");
+}
 
-    char tag[128] = {0};
-    size_t tn = tag_eo > tag_so ? (tag_eo - tag_so) : 0;
-    if (tn == 0 || tn >= sizeof(tag)) {
-      pos = start + 1;
-      continue;
-    }
-    memcpy(tag, text + tag_so, tn);
-    tag[tn] = 0;
+// A set of interned strings, as a bitmap over ids.
+typedef struct {
+  uint64_t *bits;
+  size_t nwords;
+} IdSet;
+
+static void idset_init(IdSet *st, size_t id_bound) {
+  st->nwords = (id_bound + 63) / 64;
+  st->bits = (uint64_t *)xcalloc(st->nwords ? st->nwords : 1,
+                                 sizeof(uint64_t));
+}
 
-    size_t end_block = 0;
-    if (extract_brace_block(text, start, &end_block) == (size_t)-1) {
-      pos = start + 1;
-      continue;
-    }
+static void idset_free(IdSet *st) {
+  free(st->bits);
+  st->bits = NULL;
+  st->nwords = 0;
+}
 
-    size_t end_off = end_block;
-    size_t k = end_block;
-    while (text[k] && isspace((unsigned char)text[k]))
-      k++;
-    if (text[k] == ';')
-      end_off = k + 1;
+static bool idset_has(const IdSet *st, StrId id) {
+  return id / 64 < st->nwords && (st->bits[id / 64] >> (id % 64)) & 1;
+}
 
-    int ls = count_lines_upto(text, start);
-    int le = count_lines_upto(text, end_off);
+// False if `id` was already present.
+static bool idset_add(IdSet *st, StrId id) {
+  if (id / 64 >= st->nwords)
+    return false; // interned after the set was sized: never a symbol name
+  uint64_t bit = 1ull << (id % 64);
+  bool fresh = !(st->bits[id / 64] & bit);
+  st->bits[id / 64] |= bit;
+  return fresh;
+}
 
-    Visibility vis = file_default_vis;
-    Visibility ann = annotation_visibility(raw, ls);
-    if ((int)ann != -1)
-      vis = ann;
+/* =======================
+   Declaration lexer
+   ======================= */
 
-    Symbol sym = {0};
-    sym.kind = SYM_STRUCT;
-    sym.vis = vis;
-    sym.name = xstrdup(tag);
-    sym.file = xstrdup(rel);
-    sym.line_start = ls;
-    sym.line_end = le;
-    const char *bk = file_default_backend;
-    char *annb = (char *)annotation_backend(raw, ls);
-    if (annb) {
-      bk = annb;
-    } // annb is heap
-
-    sym.backend = xstrdup(bk);
-
-    if (annb)
-      free(annb);
-
-    sym.snippet = slice_lines(raw, ls, le);
-    sym.sigline = NULL;
-    vec_push(out_syms, sym);
-
-    pos = end_off;
-  }
-
-  // --- functions (single-line sig matcher; defs get brace extraction) ---
-  int line = 1;
-  const char *p = text;
-  const char *ls_ptr = text;
-  size_t base_off = 0;
-
-  while (*p) {
-    if (*p == '\n') {
-      size_t len = (size_t)(p - ls_ptr);
-      char *ln = (char *)xmalloc(len + 1);
-      memcpy(ln, ls_ptr, len);
-      ln[len] = 0;
-
-      regmatch_t m[4];
-      if (regexec(re_fn, ln, 4, m, 0) == 0) {
-        // group 1 = name, group 2 = tail ; or {
-        char name[128] = {0};
-        size_t nso = (size_t)m[1].rm_so;
-        size_t neo = (size_t)m[1].rm_eo;
-        size_t nn = (neo > nso) ? (neo - nso) : 0;
-        if (nn > 0 && nn < sizeof(name)) {
-          memcpy(name, ln + nso, nn);
-          name[nn] = 0;
-        }
+static bool is_ident_start(int c) { return isalpha(c) || c == '_'; }
+static bool is_ident_char(int c) { return isalnum(c) || c == '_'; }
 
-        char tail = 0;
-        if (m[2].rm_so >= 0)
-          tail = ln[m[2].rm_so];
-
-        int sym_ls = line;
-
-        Visibility vis = file_default_vis;
-        Visibility ann = annotation_visibility(raw, sym_ls);
-        if ((int)ann != -1)
-          vis = ann;
-
-        if (tail == ';') {
-          Symbol sym = {0};
-          sym.kind = SYM_FN_PROTO;
-          sym.vis = vis;
-          sym.name = xstrdup(name);
-          sym.file = xstrdup(rel);
-          sym.line_start = sym_ls;
-          sym.line_end = sym_ls;
-          const char *bk = file_default_backend;
-          char *annb = (char *)annotation_backend(raw, sym_ls);
-          if (annb) {
-            bk = annb;
-          } // annb is heap
-
-          sym.backend = xstrdup(bk);
-
-          if (annb)
-            free(annb);
-
-          sym.snippet = slice_lines(raw, sym_ls, sym_ls);
-          sym.sigline = normalize_first_sigline(sym.snippet);
-          vec_push(out_syms, sym);
-        } else if (tail == '{') {
-          size_t end_block = 0;
-          if (extract_brace_block(text, base_off, &end_block) != (size_t)-1) {
-            int le = count_lines_upto(text, end_block);
-            Symbol sym = {0};
-            sym.kind = SYM_FN_DEF;
-            sym.vis = vis;
-            sym.name = xstrdup(name);
-            sym.file = xstrdup(rel);
-            sym.line_start = sym_ls;
-            sym.line_end = le;
-            const char *bk = file_default_backend;
-            char *annb = (char *)annotation_backend(raw, sym_ls);
-            if (annb) {
-              bk = annb;
-            } // annb is heap
-
-            sym.backend = xstrdup(bk);
-
-            if (annb)
-              free(annb);
-
-            sym.snippet = slice_lines(raw, sym_ls, le);
-            sym.sigline = normalize_first_sigline(sym.snippet);
-            vec_push(out_syms, sym);
-          }
-        }
-      }
+typedef enum { TOK_EOF, TOK_IDENT, TOK_PUNCT, TOK_OTHER } TokKind;
 
-      free(ln);
+typedef struct {
+  TokKind kind;
+  size_t off; // byte offset into the buffer
+  size_t len;
+  bool bol; // first token on its line (or at the lexer start)
+  bool ws;  // preceded by whitespace
+} Token;
 
-      p++;
-      line++;
-      ls_ptr = p;
-      base_off = (size_t)(p - text);
-    } else {
-      p++;
+typedef struct {
+  const char *s;
+  size_t end; // lexing stops here
+  size_t pos;
+  bool bol;
+} Lexer;
+
+static void lex_init(Lexer *lx, const char *s, size_t pos, size_t end) {
+  lx->s = s;
+  lx->end = end;
+  lx->pos = pos;
+  lx->bol = true;
+}
+
+// Identifiers, single punctuation characters, and "other" tokens (numbers,
+// string and char literals). Comments are already blanked.
+static Token lex_next(Lexer *lx) {
+  const char *s = lx->s;
+  size_t i = lx->pos, n = lx->end;
+  Token t = {TOK_EOF, 0, 0, false, false};
+  while (i < n && isspace((unsigned char)s[i])) {
+    if (s[i] == '\n')
+      lx->bol = true;
+    t.ws = true;
+    i++;
+  }
+  t.off = i;
+  t.bol = lx->bol;
+  if (i >= n) {
+    lx->pos = n;
+    return t;
+  }
+  lx->bol = false;
+
+  unsigned char c = (unsigned char)s[i];
+  if (is_ident_start(c)) {
+    while (i < n && is_ident_char((unsigned char)s[i]))
+      i++;
+    t.kind = TOK_IDENT;
+  } else if (isdigit(c)) {
+    while (i < n && (is_ident_char((unsigned char)s[i]) || s[i] == '.'))
+      i++;
+    t.kind = TOK_OTHER;
+  } else if (c == '"' || c == '\'') {
+    i++;
+    while (i < n && s[i] != (char)c && s[i] != '\n') {
+      if (s[i] == '\\' && i + 1 < n)
+        i++;
+      i++;
     }
+    if (i < n && s[i] == (char)c)
+      i++;
+    t.kind = TOK_OTHER;
+  } else {
+    i++;
+    t.kind = TOK_PUNCT;
   }
+  t.len = i - t.off;
+  lx->pos = i;
+  return t;
+}
 
-  free(text);
-  free(raw);
+static bool tok_word(const char *s, Token t, const char *word) {
+  size_t n = strlen(word);
+  return t.kind == TOK_IDENT && t.len == n && memcmp(s + t.off, word, n) == 0;
 }
 
-static void walk_dir(const char *root, const char *path, SymVec *syms,
-                     regex_t *re_fn, regex_t *re_typedef_struct,
-                     regex_t *re_struct) {
+static bool tok_punct(const char *s, Token t, char c) {
+  return t.kind == TOK_PUNCT && s[t.off] == c;
+}
 
-  DIR *d = opendir(path);
-  if (!d)
-    return;
+// An identifier with no lowercase letters and at least one uppercase one.
+static bool tok_all_caps(const char *s, Token t) {
+  if (t.kind != TOK_IDENT)
+    return false;
+  bool upper = false;
+  for (size_t i = 0; i < t.len; i++) {
+    unsigned char c = (unsigned char)s[t.off + i];
+    if (islower(c))
+      return false;
+    if (isupper(c))
+      upper = true;
+  }
+  return upper;
+}
 
-  struct dirent *ent;
-  while ((ent = readdir(d)) != NULL) {
-    const char *name = ent->d_name;
-    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
-      continue;
+// An all-caps identifier alone on its line (__BEGIN_DECLS, G_BEGIN_DECLS,
+// EXPORT macros) is not treated as the start of the next declaration,
+// unless the next line opens with `name (`: then it is a return type in
+// GNU style (BOOL on one line, foo(int); on the next).
+static bool is_macro_line(const char *s, Token t, const Lexer *lx) {
+  if (!t.bol || !tok_all_caps(s, t))
+    return false;
+  Lexer la = *lx;
+  Token u = lex_next(&la);
+  if (u.kind == TOK_EOF)
+    return true;
+  if (!u.bol)
+    return false;
+  Token v = lex_next(&la);
+  return !(u.kind == TOK_IDENT && !tok_all_caps(s, u) && tok_punct(s, v, '('));
+}
 
-    if (strcmp(name, ".git") == 0 || strcmp(name, "build") == 0 ||
-        strcmp(name, "dist") == 0 || strcmp(name, "out") == 0 ||
-        strcmp(name, ".cache") == 0 || strcmp(name, ".vscode") == 0) {
-      continue;
-    }
+/* =======================
+   Make jobserver client
+   ======================= */
+
+// Under `make -jN` the build hands out CPU slots as one-byte tokens on a pipe
+// or fifo named in MAKEFLAGS (--jobserver-auth=R,W or =fifo:PATH). This
+// process runs on the slot make started it with; every extra worker thread
+// must hold a token while it runs tasks and return it when it goes idle.
+
+typedef struct {
+  bool active;
+  int rfd, wfd;
+  pthread_mutex_t lock;
+  char *held; // bytes of the tokens currently held, returned as read
+  size_t nheld, cap;
+} Jobserver;
+
+static Jobserver g_jobserver = {false, -1, -1, PTHREAD_MUTEX_INITIALIZER,
+                                NULL, 0, 0};
+
+static void jobserver_release_all(void) {
+  Jobserver *js = &g_jobserver;
+  pthread_mutex_lock(&js->lock);
+  for (; js->nheld > 0; js->nheld--)
+    while (write(js->wfd, &js->held[js->nheld - 1], 1) < 0 && errno == EINTR)
+      ;
+  pthread_mutex_unlock(&js->lock);
+}
 
-    char *child = path_join(path, name);
-    if (is_dir(child)) {
-      walk_dir(root, child, syms, re_fn, re_typedef_struct, re_struct);
-    } else if (is_file(child) && has_c_ext(child)) {
-      scan_file(child, root, syms, re_fn, re_typedef_struct, re_struct);
+// Connect to the jobserver named in MAKEFLAGS, if any. Reads go through a
+// descriptor of our own opened O_NONBLOCK, so a token taken by a sibling
+// between poll() and read() cannot block a worker.
+static void jobserver_init(void) {
+  const char *mf = getenv("MAKEFLAGS");
+  if (!mf)
+    return;
+  const char *auth = NULL;
+  const char *keys[] = {"--jobserver-auth=", "--jobserver-fds="};
+  for (int k = 0; k < 2 && !auth; k++)
+    for (const char *p = mf; (p = strstr(p, keys[k])) != NULL; p++)
+      auth = p + strlen(keys[k]); // the last one wins, as in make
+  if (!auth)
+    return;
+  size_t n = strcspn(auth, " ");
+  Jobserver *js = &g_jobserver;
+
+  if (strncmp(auth, "fifo:", 5) == 0) {
+    char *path = xstrndup(auth + 5, n - 5);
+    js->rfd = js->wfd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    free(path);
+  } else {
+    int r, w;
+    if (sscanf(auth, "%d,%d", &r, &w) != 2 || r < 0 || w < 0)
+      return;
+    if (fcntl(r, F_GETFD) < 0 || fcntl(w, F_GETFD) < 0) {
+      fprintf(stderr, "warning: jobserver unavailable (mark the make rule "
+                      "with '+' to pass it on); using --jobs as given\n");
+      return;
     }
-    free(child);
+    char self[64];
+    snprintf(self, sizeof(self), "/proc/self/fd/%d", r);
+    js->rfd = open(self, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (js->rfd < 0)
+      js->rfd = r; // no /proc: poll() then a read that may briefly block
+    js->wfd = w;
   }
-  closedir(d);
+  if (js->rfd < 0)
+    return;
+  js->active = true;
+  atexit(jobserver_release_all);
 }
 
-static void free_syms(SymVec *v) {
-  for (size_t i = 0; i < v->len; i++) {
-    free(v->data[i].name);
-    free(v->data[i].file);
-    free(v->data[i].backend);
-    free(v->data[i].snippet);
-    free(v->data[i].sigline);
+// Wait for a token. False if `wake_fd` turns readable first (the caller no
+// longer needs one) or the jobserver is gone.
+static bool jobserver_acquire(int wake_fd) {
+  Jobserver *js = &g_jobserver;
+  for (;;) {
+    struct pollfd pfd[2] = {{js->rfd, POLLIN, 0}, {wake_fd, POLLIN, 0}};
+    if (poll(pfd, 2, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    if (pfd[1].revents)
+      return false;
+    if (!pfd[0].revents)
+      continue;
+    char tok;
+    ssize_t got = read(js->rfd, &tok, 1);
+    if (got == 1) {
+      pthread_mutex_lock(&js->lock);
+      if (js->nheld == js->cap) {
+        js->cap = js->cap ? js->cap * 2 : 16;
+        js->held = (char *)xrealloc(js->held, js->cap);
+      }
+      js->held[js->nheld++] = tok;
+      pthread_mutex_unlock(&js->lock);
+      return true;
+    }
+    if (got == 0 || (errno != EAGAIN && errno != EINTR))
+      return false; // make is gone
   }
-  free(v->data);
-  v->data = NULL;
-  v->len = v->cap = 0;
 }
 
-static void ensure_parent_dir(const char *path) {
-  char *dup = xstrdup(path);
-  char *slash = strrchr(dup, '/');
-  if (slash) {
-    *slash = 0;
-    if (*dup)
-      mkdir(dup, 0755);
+static void jobserver_release(void) {
+  Jobserver *js = &g_jobserver;
+  pthread_mutex_lock(&js->lock);
+  if (js->nheld > 0) {
+    char tok = js->held[--js->nheld];
+    while (write(js->wfd, &tok, 1) < 0 && errno == EINTR)
+      ;
   }
-  free(dup);
+  pthread_mutex_unlock(&js->lock);
 }
 
 /* =======================
-   Emit: index.json + api.def
+   Thread pool (work stealing)
    ======================= */
 
-static void write_index_json(const char *index_path, const SymVec *syms) {
-  FILE *f = fopen(index_path, "wb");
-  if (!f)
-    die("failed to open index output");
+// Fork-join pool over integer task ids. Every worker owns a deque: it pops
+// its own work from the back and, when that runs dry, takes a batch from the
+// shared injector queue and then steals from the front of the others.
+// Running tasks may push further tasks; threads outside the pool feed the
+// bounded injector, blocking while it is full. The pool returns once
+// every pushed task has finished and no hold is outstanding. The calling
+// thread is worker 0.
 
-  fputc('[', f);
-  for (size_t i = 0; i < syms->len; i++) {
-    const Symbol *s = &syms->data[i];
-    if (i)
-      fputc(',', f);
-    fputc('\n', f);
-    fputs("  {\"kind\":", f);
-    json_escape_write(f, kind_str(s->kind));
-    fputs(",\"vis\":", f);
-    json_escape_write(f, vis_str(s->vis));
-    fputs(",\"name\":", f);
-    json_escape_write(f, s->name);
-    fputs(",\"file\":", f);
-    json_escape_write(f, s->file);
-    fprintf(f, ",\"line_start\":%d,\"line_end\":%d", s->line_start,
-            s->line_end);
-    fputs(",\"backend\":", f);
-    json_escape_write(f, s->backend ? s->backend : "core");
-    fputs(",\"snippet\":", f);
-    json_escape_write(f, s->snippet);
-    fputc('}', f);
-  }
-  fputs("\n]\n", f);
-  fclose(f);
+typedef void (*TaskFn)(void *arg, size_t task, int worker);
+
+typedef struct {
+  pthread_mutex_t lock;
+  size_t *items;
+  size_t head, tail, cap; // live items are [head, tail)
+} TaskDeque;
+
+typedef struct Pool {
+  int nworkers;
+  TaskDeque *deques;
+  TaskFn fn;
+  void *arg;
+  atomic_size_t pending; // pushed but not yet finished, plus holds
+  pthread_mutex_t idle_lock;
+  pthread_cond_t idle_cond;
+  unsigned long pushes; // bumped under idle_lock, wakes idle workers
+  int idle;             // workers waiting on idle_cond
+  // bounded ring of tasks from outside producers, guarded by idle_lock
+  size_t *inj;
+  size_t inj_head, inj_len, inj_cap;
+  pthread_cond_t inj_not_full;
+  int inj_blocked; // producers waiting on inj_not_full
+  int done_pipe[2]; // readable once all work is done; wakes token waiters
+} Pool;
+
+typedef struct {
+  Pool *pool;
+  int id;
+} PoolWorker;
+
+static int online_cpus(void) {
+#ifdef _SC_NPROCESSORS_ONLN
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n > 0)
+    return n > 1024 ? 1024 : (int)n;
+#endif
+  return 1;
 }
 
-static bool starts_with(const char *s, const char *prefix) {
-  if (!prefix || !*prefix)
-    return true;
-  size_t n = strlen(prefix);
-  return strncmp(s, prefix, n) == 0;
+static void deque_push(TaskDeque *dq, size_t task) {
+  pthread_mutex_lock(&dq->lock);
+  if (dq->tail == dq->cap) {
+    if (dq->head > 0) {
+      memmove(dq->items, dq->items + dq->head,
+              (dq->tail - dq->head) * sizeof(size_t));
+      dq->tail -= dq->head;
+      dq->head = 0;
+    } else {
+      dq->cap = dq->cap ? dq->cap * 2 : 64;
+      dq->items = (size_t *)xrealloc(dq->items, dq->cap * sizeof(size_t));
+    }
+  }
+  dq->items[dq->tail++] = task;
+  pthread_mutex_unlock(&dq->lock);
 }
 
-static bool backend_allowed(const char *sym_backend,
-                            const char *allow_backend,
-                            const char *exclude_backend) {
-  const char *b = sym_backend ? sym_backend : "core";
+static bool deque_pop_back(TaskDeque *dq, size_t *task) {
+  pthread_mutex_lock(&dq->lock);
+  bool ok = dq->tail > dq->head;
+  if (ok)
+    *task = dq->items[--dq->tail];
+  pthread_mutex_unlock(&dq->lock);
+  return ok;
+}
 
-  if (exclude_backend && strcmp(b, exclude_backend) == 0) return false;
+static bool deque_steal_front(TaskDeque *dq, size_t *task) {
+  pthread_mutex_lock(&dq->lock);
+  bool ok = dq->tail > dq->head;
+  if (ok)
+    *task = dq->items[dq->head++];
+  pthread_mutex_unlock(&dq->lock);
+  return ok;
+}
 
-  if (!allow_backend || !*allow_backend) return true; // no allow filter
+// Queue a task on `worker`'s deque. Safe from inside a running task.
+static void pool_push(Pool *p, int worker, size_t task) {
+  atomic_fetch_add(&p->pending, 1);
+  deque_push(&p->deques[worker], task);
+  pthread_mutex_lock(&p->idle_lock);
+  p->pushes++;
+  if (p->idle > 0)
+    pthread_cond_signal(&p->idle_cond);
+  pthread_mutex_unlock(&p->idle_lock);
+}
 
-  // allow_backend means: allow that backend + "core"
-  if (strcmp(b, "core") == 0) return true;
-  return strcmp(b, allow_backend) == 0;
+// Queue a task from a thread outside the pool, waiting while the injector
+// is full so a fast producer cannot run arbitrarily far ahead.
+static void pool_inject(Pool *p, size_t task) {
+  atomic_fetch_add(&p->pending, 1);
+  pthread_mutex_lock(&p->idle_lock);
+  p->inj_blocked++;
+  while (p->inj_len == p->inj_cap)
+    pthread_cond_wait(&p->inj_not_full, &p->idle_lock);
+  p->inj_blocked--;
+  p->inj[(p->inj_head + p->inj_len++) % p->inj_cap] = task;
+  p->pushes++;
+  if (p->idle > 0)
+    pthread_cond_signal(&p->idle_cond);
+  pthread_mutex_unlock(&p->idle_lock);
 }
 
-static void emit_api_def(const char *out_path, const SymVec *syms,
-                         const char *fn_prefix, const char *allow_backend, const char *exclude_backend) {
-  FILE *f = fopen(out_path, "wb");
-  if (!f)
-    die("failed to open api.def output");
+// A hold keeps workers alive while a producer may still inject tasks.
+static void pool_hold(Pool *p) { atomic_fetch_add(&p->pending, 1); }
+
+static void pool_release(Pool *p) {
+  if (atomic_fetch_sub(&p->pending, 1) == 1) {
+    pthread_mutex_lock(&p->idle_lock);
+    pthread_cond_broadcast(&p->idle_cond);
+    pthread_mutex_unlock(&p->idle_lock);
+    if (p->done_pipe[1] >= 0)
+      while (write(p->done_pipe[1], "", 1) < 0 && errno == EINTR)
+        ;
+  }
+}
 
-  fputs("/* AUTO-GENERATED: do not edit by hand */\n", f);
-  fputs("/* Generated by api_tool.c */\n\n", f);
+// Take one injected task, and move a fair share of the rest onto our own
+// deque where idle workers can steal them without touching the injector.
+static bool pool_take_injected(Pool *p, int self, size_t *task) {
+  size_t batch[16];
+  size_t nbatch = 0;
+  pthread_mutex_lock(&p->idle_lock);
+  bool ok = p->inj_len > 0;
+  if (ok) {
+    size_t share = (p->inj_len - 1) / (size_t)p->nworkers;
+    nbatch = 1 + (share < 15 ? share : 15);
+    for (size_t i = 0; i < nbatch; i++) {
+      batch[i] = p->inj[p->inj_head];
+      p->inj_head = (p->inj_head + 1) % p->inj_cap;
+    }
+    p->inj_len -= nbatch;
+    if (p->inj_blocked > 0)
+      pthread_cond_broadcast(&p->inj_not_full);
+  }
+  pthread_mutex_unlock(&p->idle_lock);
+  if (!ok)
+    return false;
+  *task = batch[0];
+  for (size_t i = nbatch; i > 1; i--) // popped from the back, so in order
+    deque_push(&p->deques[self], batch[i - 1]);
+  if (nbatch > 1) {
+    pthread_mutex_lock(&p->idle_lock);
+    p->pushes++;
+    if (p->idle > 0)
+      pthread_cond_broadcast(&p->idle_cond);
+    pthread_mutex_unlock(&p->idle_lock);
+  }
+  return true;
+}
 
-  fputs("/* TYPES */\n", f);
-  for (size_t i = 0; i < syms->len; i++) {
-    const Symbol *s = &syms->data[i];
-    if (!(s->kind == SYM_TYPEDEF_STRUCT || s->kind == SYM_STRUCT))
-      continue;
+static bool pool_take(Pool *p, int self, size_t *task) {
+  if (deque_pop_back(&p->deques[self], task))
+    return true;
+  if (pool_take_injected(p, self, task))
+    return true;
+  for (int k = 1; k < p->nworkers; k++)
+    if (deque_steal_front(&p->deques[(self + k) % p->nworkers], task))
+      return true;
+  return false;
+}
 
-    if (!backend_allowed(s->backend, allow_backend, exclude_backend)) continue;
+static void *pool_worker_main(void *argp) {
+  PoolWorker *w = (PoolWorker *)argp;
+  Pool *p = w->pool;
+  bool need_token = w->id != 0 && g_jobserver.active, have_token = false;
+  for (;;) {
+    pthread_mutex_lock(&p->idle_lock);
+    unsigned long seen = p->pushes;
+    pthread_mutex_unlock(&p->idle_lock);
+
+    if (need_token && !have_token) {
+      have_token = jobserver_acquire(p->done_pipe[0]);
+      if (!have_token)
+        break; // all work finished while we waited
+    }
 
-    const char *sn = s->snippet;
-    const char *lb = strchr(sn, '{');
-    const char *rb = strrchr(sn, '}');
-    if (!lb || !rb || rb <= lb)
+    size_t task;
+    if (pool_take(p, w->id, &task)) {
+      p->fn(p->arg, task, w->id);
+      pool_release(p);
       continue;
-
-    fprintf(f, "API_TYPE(%s, %s,\n", vis_str(s->vis), s->name);
-
-    const char *p = lb + 1;
-    while (p < rb) {
-      const char *e = strchr(p, '\n');
-      if (!e || e > rb)
-        e = rb;
-      const char *end = e;
-      while (end > p && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'))
-        end--;
-      fputs("  ", f);
-      fwrite(p, 1, (size_t)(end - p), f);
-      fputc('\n', f);
-      if (e == rb)
-        break;
-      p = e + 1;
     }
 
-    fputs(")\n\n", f);
+    // Nothing to take: hand the token back and sleep until a push or until
+    // all work is done.
+    if (have_token) {
+      jobserver_release();
+      have_token = false;
+    }
+    pthread_mutex_lock(&p->idle_lock);
+    p->idle++;
+    while (atomic_load(&p->pending) > 0 && p->pushes == seen)
+      pthread_cond_wait(&p->idle_cond, &p->idle_lock);
+    p->idle--;
+    bool done = atomic_load(&p->pending) == 0;
+    pthread_mutex_unlock(&p->idle_lock);
+    if (done)
+      break;
   }
+  if (have_token)
+    jobserver_release();
+  if (w->id != 0)
+    stats_flush();
+  return NULL;
+}
 
-  fputs("/* FUNCTIONS (prototypes) */\n", f);
-  for (size_t i = 0; i < syms->len; i++) {
-    const Symbol *s = &syms->data[i];
-    if (s->kind != SYM_FN_PROTO)
-      continue;
-    if (!starts_with(s->name, fn_prefix))
-      continue;
-    if (!s->sigline)
-      continue;
-
-    if (!backend_allowed(s->backend, allow_backend, exclude_backend)) continue;
+static void pool_init(Pool *p, int nworkers, size_t inject_cap, TaskFn fn,
+                      void *arg) {
+  p->nworkers = nworkers < 1 ? 1 : nworkers;
+  p->deques = (TaskDeque *)xcalloc((size_t)p->nworkers, sizeof(TaskDeque));
+  for (int i = 0; i < p->nworkers; i++)
+    pthread_mutex_init(&p->deques[i].lock, NULL);
+  p->fn = fn;
+  p->arg = arg;
+  atomic_init(&p->pending, 0);
+  pthread_mutex_init(&p->idle_lock, NULL);
+  pthread_cond_init(&p->idle_cond, NULL);
+  p->pushes = 0;
+  p->idle = 0;
+  p->inj_cap = inject_cap ? inject_cap : 1;
+  p->inj = (size_t *)xmalloc(p->inj_cap * sizeof(size_t));
+  p->inj_head = p->inj_len = 0;
+  pthread_cond_init(&p->inj_not_full, NULL);
+  p->inj_blocked = 0;
+  p->done_pipe[0] = p->done_pipe[1] = -1;
+  if (g_jobserver.active && p->nworkers > 1) {
+    if (pipe(p->done_pipe) != 0)
+      die("pipe failed");
+    fcntl(p->done_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(p->done_pipe[1], F_SETFD, FD_CLOEXEC);
+  }
+}
 
-    // Parse ret + name + args: find '(' then last identifier before it.
-    const char *sig = s->sigline;
-    const char *lp = strchr(sig, '(');
-    if (!lp)
-      continue;
+// Run until every queued task, and every task they push, has finished.
+static void pool_run(Pool *p) {
+  int n = p->nworkers;
+  pthread_t *threads = (pthread_t *)xmalloc((size_t)n * sizeof(pthread_t));
+  PoolWorker *ws = (PoolWorker *)xmalloc((size_t)n * sizeof(PoolWorker));
+  for (int i = 0; i < n; i++) {
+    ws[i].pool = p;
+    ws[i].id = i;
+  }
+  for (int i = 1; i < n; i++)
+    if (pthread_create(&threads[i], NULL, pool_worker_main, &ws[i]) != 0)
+      die("failed to start worker thread");
+  pool_worker_main(&ws[0]);
+  for (int i = 1; i < n; i++)
+    pthread_join(threads[i], NULL);
+  free(ws);
+  free(threads);
+}
 
-    const char *q = lp;
-    while (q > sig && isspace((unsigned char)q[-1]))
-      q--;
-    const char *end_id = q;
-    while (q > sig && (isalnum((unsigned char)q[-1]) || q[-1] == '_'))
-      q--;
-    const char *start_id = q;
+static void pool_destroy(Pool *p) {
+  for (int i = 0; i < p->nworkers; i++) {
+    pthread_mutex_destroy(&p->deques[i].lock);
+    free(p->deques[i].items);
+  }
+  free(p->deques);
+  pthread_mutex_destroy(&p->idle_lock);
+  pthread_cond_destroy(&p->idle_cond);
+  pthread_cond_destroy(&p->inj_not_full);
+  free(p->inj);
+  if (p->done_pipe[0] >= 0) {
+    close(p->done_pipe[0]);
+    close(p->done_pipe[1]);
+  }
+}
 
-    // return type is [sig..start_id)
-    size_t ret_len = (size_t)(start_id - sig);
-    while (ret_len > 0 && isspace((unsigned char)sig[ret_len - 1]))
-      ret_len--;
+/* =======================
+   Scanning
+   ======================= */
 
-    char *ret = (char *)xmalloc(ret_len + 1);
-    memcpy(ret, sig, ret_len);
-    ret[ret_len] = 0;
+typedef struct {
+  const SrcFile *src;
+  const char *text;
+  size_t len;
+  const LineIndex *lines;
+  const AnnotationVec *anns;
+  const BraceTable *braces;
+  size_t brace_cursor;
+  StrId file;
+  StrId default_backend;
+  Visibility default_vis;
+  SymVec *out;
+  MaskScan masks; // structural masks over `text`, for skipping bodies
+} ScanCtx;
+
+// `sig_end` is the offset of the ';' or '{' ending a function signature
+// (unused for other kinds).
+static void emit_symbol(ScanCtx *cx, SymKind kind, const char *name,
+                        size_t name_len, size_t start_off, size_t end_off,
+                        size_t sig_end) {
+  int ls = line_index_line_of(cx->lines, start_off);
+  int le = line_index_line_of(cx->lines, end_off);
+
+  Visibility vis = cx->default_vis;
+  Visibility ann = annotation_visibility(cx->anns, ls);
+  if ((int)ann != -1)
+    vis = ann;
+
+  Symbol sym = {0};
+  sym.kind = kind;
+  sym.vis = vis;
+  sym.name = intern(name, name_len);
+  sym.file = cx->file;
+  sym.line_start = ls;
+  sym.line_end = le;
+  const char *annb = annotation_backend(cx->anns, ls);
+  sym.backend = annb ? intern_str(annb) : cx->default_backend;
+
+  sym.src = cx->src;
+  sym.snippet_off = line_index_start(cx->lines, ls);
+  sym.snippet_len = line_index_start(cx->lines, le + 1) - sym.snippet_off;
+  sym.sigline = NULL;
+  if (kind == SYM_FN_PROTO || kind == SYM_FN_DEF)
+    sym.sigline =
+        normalize_sigline(cx->text + start_off, sig_end - start_off);
+  vec_push(cx->out, sym);
+}
 
-    fprintf(f, "API_FN(%s, %s, %s, %s)\n", vis_str(s->vis), ret, s->name, lp);
+// Offset just past the '}' matching the '{' at `brace` (buffer end if the
+// block is unbalanced).
+static size_t skip_block(ScanCtx *cx, size_t brace) {
+  return brace_table_close(cx->braces, &cx->brace_cursor, brace, cx->len);
+}
 
-    free(ret);
+// Next token, skipping preprocessor directives.
+static Token next_decl_token(ScanCtx *cx, Lexer *lx) {
+  for (;;) {
+    Token t = lex_next(lx);
+    if (!t.bol || !tok_punct(cx->text, t, '#'))
+      return t;
+    lx->pos = directive_end(cx->text, t.off, cx->len);
   }
-
-  fclose(f);
 }
 
-/* =======================
-   SEARCH (direct scan)
-   ======================= */
+// Consume the rest of a declaration, jumping over brace blocks. Returns the
+// offset of its ';' (buffer end if there is none); *last is the final token
+// before it.
+static size_t skip_to_decl_end(ScanCtx *cx, Lexer *lx, Token *last) {
+  const char *s = cx->text;
+  const unsigned stops =
+      CLS(CLS_SEMI) | CLS(CLS_BRACE) | CLS(CLS_HASH) | CLS(CLS_QUOTE);
+  for (;;) {
+    if (!last) {
+      // nothing to record: jump straight to the next token that matters
+      size_t p = mask_next(&cx->masks, lx->pos, stops);
+      if (p > lx->pos) {
+        size_t k = p;
+        while (k > lx->pos && s[k - 1] != '\n' &&
+               isspace((unsigned char)s[k - 1]))
+          k--;
+        if (k > lx->pos)
+          lx->bol = s[k - 1] == '\n';
+        lx->pos = p;
+      }
+    }
+    Token t = next_decl_token(cx, lx);
+    if (t.kind == TOK_EOF)
+      return cx->len;
+    if (tok_punct(s, t, ';'))
+      return t.off;
+    if (tok_punct(s, t, '{'))
+      lx->pos = skip_block(cx, t.off);
+    else if (last)
+      *last = t;
+  }
+}
 
-static bool contains_case(const char *hay, const char *needle) {
-  if (!needle || !*needle)
-    return true;
-  if (!hay)
+// "typedef struct [TAG] {" or "struct TAG {" at the start of a declaration.
+static bool struct_head(const char *s, Token first, const Lexer *lx,
+                        bool *is_typedef, Token *tag, Token *brace) {
+  Lexer la = *lx;
+  Token u = first;
+  *is_typedef = tok_word(s, u, "typedef");
+  if (*is_typedef)
+    u = lex_next(&la);
+  if (!tok_word(s, u, "struct"))
+    return false;
+  u = lex_next(&la);
+  *tag = (Token){TOK_EOF, u.off, 0, false, false};
+  if (u.kind == TOK_IDENT) {
+    *tag = u;
+    u = lex_next(&la);
+  } else if (!*is_typedef) {
     return false;
-  size_t n = strlen(needle);
-  for (const char *p = hay; *p; p++) {
-    size_t i = 0;
-    while (i < n && p[i] &&
-           tolower((unsigned char)p[i]) == tolower((unsigned char)needle[i]))
-      i++;
-    if (i == n)
-      return true;
   }
-  return false;
+  *brace = u;
+  return tok_punct(s, u, '{');
 }
 
-static bool kind_match(SymKind k, const char *kind_s) {
-  if (!kind_s)
-    return true;
-  if (strcmp(kind_s, "fn") == 0)
-    return k == SYM_FN_PROTO || k == SYM_FN_DEF;
-  if (strcmp(kind_s, "fn_proto") == 0)
-    return k == SYM_FN_PROTO;
-  if (strcmp(kind_s, "fn_def") == 0)
-    return k == SYM_FN_DEF;
-  if (strcmp(kind_s, "struct") == 0)
-    return k == SYM_STRUCT || k == SYM_TYPEDEF_STRUCT;
-  if (strcmp(kind_s, "typedef_struct") == 0)
-    return k == SYM_TYPEDEF_STRUCT;
-  return true;
+static void scan_struct(ScanCtx *cx, Lexer *lx, Token first,
+                        bool is_typedef, Token tag, Token brace) {
+  const char *s = cx->text;
+  size_t end_block = skip_block(cx, brace.off);
+  lx->pos = end_block;
+
+  if (is_typedef) {
+    // the typedef name is the last identifier before the ';'
+    Token last = {TOK_EOF, 0, 0, false, false};
+    size_t semi = skip_to_decl_end(cx, lx, &last);
+    size_t end_off = semi < cx->len ? semi + 1 : end_block;
+    if (last.kind == TOK_IDENT)
+      emit_symbol(cx, SYM_TYPEDEF_STRUCT, s + last.off, last.len, first.off,
+                  end_off, 0);
+    else
+      emit_symbol(cx, SYM_TYPEDEF_STRUCT, "ANON_TYPEDEF_STRUCT", 19,
+                  first.off, end_off, 0);
+    return;
+  }
+
+  // "struct TAG { ... };" ends at the ';'; declarators after the body are
+  // consumed without producing symbols.
+  Lexer la = *lx;
+  Token u = lex_next(&la);
+  size_t end_off = end_block;
+  if (tok_punct(s, u, ';')) {
+    end_off = u.off + 1;
+    *lx = la;
+  } else {
+    skip_to_decl_end(cx, lx, NULL);
+  }
+  emit_symbol(cx, SYM_STRUCT, s + tag.off, tag.len, first.off, end_off, 0);
 }
 
-static void do_search(const SymVec *syms, const char *kind_s, const char *name,
-                      const char *pattern) {
-  for (size_t i = 0; i < syms->len; i++) {
-    const Symbol *s = &syms->data[i];
-    if (!kind_match(s->kind, kind_s))
+// Classify one top-level declaration starting at `first`. Function
+// signatures are [IDENT|'*']+ NAME '(' ... ')' followed only by identifiers
+// or parenthesized attributes before ';' or '{'.
+static void scan_decl(ScanCtx *cx, Lexer *lx, Token first,
+                      int *open_scopes) {
+  const char *s = cx->text;
+
+  bool is_typedef;
+  Token tag, brace;
+  if (struct_head(s, first, lx, &is_typedef, &tag, &brace)) {
+    scan_struct(cx, lx, first, is_typedef, tag, brace);
+    return;
+  }
+
+  bool fn_ok = first.kind == TOK_IDENT && !tok_word(s, first, "typedef");
+  bool scope_ok =
+      tok_word(s, first, "extern") || tok_word(s, first, "namespace");
+  bool seen_paren = false, in_params = false, params_done = false;
+  int ntok = 0, paren = 0;
+  Token prev = {TOK_EOF, 0, 0, false, false};
+  Token name = prev;
+
+  for (Token t = first;; prev = t, t = next_decl_token(cx, lx)) {
+    if (t.kind == TOK_EOF)
+      return;
+    ntok++;
+
+    if (tok_punct(s, t, '(')) {
+      if (paren == 0 && !seen_paren) {
+        seen_paren = true;
+        if (fn_ok && ntok >= 3 && prev.kind == TOK_IDENT) {
+          name = prev;
+          in_params = true;
+        } else {
+          fn_ok = false;
+        }
+      }
+      paren++;
+      scope_ok = false;
       continue;
-    if (name && *name && strcmp(s->name, name) != 0)
+    }
+    if (tok_punct(s, t, ')')) {
+      if (paren > 0 && --paren == 0 && in_params) {
+        in_params = false;
+        params_done = true;
+      }
       continue;
-    if (pattern && *pattern) {
-      if (!contains_case(s->name, pattern) &&
-          !contains_case(s->snippet, pattern))
-        continue;
     }
-    printf("\n== %s/%s: %s  (%s:%d-%d) ==\n", vis_str(s->vis),
-           kind_str(s->kind), s->name, s->file, s->line_start, s->line_end);
-    puts(s->snippet);
-  }
-}
-
-/* =======================
-   NEEDS: auto-import generation
-   ======================= */
 
-static bool is_ident_start(int c) { return isalpha(c) || c == '_'; }
-static bool is_ident_char(int c) { return isalnum(c) || c == '_'; }
+    // the signature may span lines up to its ';' or '{'
+    bool fn = fn_ok && params_done;
 
-static void collect_idents_from_text(const char *text, StrSet *idents) {
-  const char *p = text;
-  while (*p) {
-    if (is_ident_start((unsigned char)*p)) {
-      const char *s = p;
-      p++;
-      while (*p && is_ident_char((unsigned char)*p))
-        p++;
-      size_t n = (size_t)(p - s);
-      if (n < 256) {
-        char buf[256];
-        memcpy(buf, s, n);
-        buf[n] = 0;
-        set_add(idents, buf);
+    if (tok_punct(s, t, ';')) {
+      if (fn)
+        emit_symbol(cx, SYM_FN_PROTO, s + name.off, name.len, first.off,
+                    t.off, t.off);
+      return;
+    }
+    if (tok_punct(s, t, '{')) {
+      if (scope_ok) {
+        // extern "C" { ... } / namespace [X] { ... } stay at top level
+        (*open_scopes)++;
+        return;
       }
-    } else {
-      p++;
+      size_t end_block = skip_block(cx, t.off);
+      lx->pos = end_block;
+      if (fn) {
+        emit_symbol(cx, SYM_FN_DEF, s + name.off, name.len, first.off,
+                    end_block, t.off);
+        return;
+      }
+      // other bodies (enum, union, initializers): function-like heads end
+      // at the '}', everything else runs to its ';'
+      if (!seen_paren && ntok > 1)
+        skip_to_decl_end(cx, lx, NULL);
+      return;
     }
+    if (tok_punct(s, t, '}')) {
+      // closes an enclosing extern "C" / namespace block
+      if (*open_scopes > 0)
+        (*open_scopes)--;
+      return;
+    }
+
+    if (ntok == 2 && scope_ok)
+      scope_ok = t.kind == TOK_IDENT ||
+                 (t.kind == TOK_OTHER && s[t.off] == '"');
+    else if (ntok > 2)
+      scope_ok = false;
+
+    if (paren > 0)
+      continue;
+    if (!seen_paren ? (t.kind != TOK_IDENT && !tok_punct(s, t, '*'))
+                    : (t.kind != TOK_IDENT || !params_done))
+      fn_ok = false;
   }
 }
 
-static void build_api_name_sets(const SymVec *syms, StrSet *all_names,
-                                StrSet *type_names, StrSet *fn_names) {
-  set_init(all_names, 2048);
-  set_init(type_names, 2048);
-  set_init(fn_names, 2048);
-
-  for (size_t i = 0; i < syms->len; i++) {
-    const Symbol *s = &syms->data[i];
-    set_add(all_names, s->name);
-    if (s->kind == SYM_FN_PROTO || s->kind == SYM_FN_DEF)
-      set_add(fn_names, s->name);
-    if (s->kind == SYM_STRUCT || s->kind == SYM_TYPEDEF_STRUCT)
-      set_add(type_names, s->name);
+// One pass over [lo, hi) of the stripped buffer. Only top-level declarations
+// are classified; bodies are jumped over, so nested structs and statements
+// inside functions never produce symbols. A range other than the whole
+// buffer must start and end right after a top-level ';' (see
+// find_chunk_bounds).
+static void scan_decls(ScanCtx *cx, size_t lo, size_t hi) {
+  const char *s = cx->text;
+  Lexer lx;
+  lex_init(&lx, s, lo, hi);
+  lx.bol = lo == 0; // a chunk starts just after a ';'
+  cx->brace_cursor = brace_table_seek(cx->braces, lo);
+  int open_scopes = 0;
+
+  for (;;) {
+    Token t = next_decl_token(cx, &lx);
+    if (t.kind == TOK_EOF)
+      break;
+    if (tok_punct(s, t, '}')) {
+      if (open_scopes > 0)
+        open_scopes--;
+      continue;
+    }
+    if (tok_punct(s, t, ';') || is_macro_line(s, t, &lx))
+      continue;
+    scan_decl(cx, &lx, t, &open_scopes);
   }
 }
 
-static const Symbol *find_symbol(const SymVec *syms, const char *name) {
-  for (size_t i = 0; i < syms->len; i++) {
-    if (strcmp(syms->data[i].name, name) == 0)
-      return &syms->data[i];
+// A loaded file with every whole-file pass done, ready for scan_decls over
+// any of its chunks.
+typedef struct {
+  SrcFile *src;
+  LineIndex lines;
+  AnnotationVec anns;
+  BraceTable braces;
+  StrId file;
+  StrId default_backend;
+  Visibility default_vis;
+} FileScan;
+
+// Prepare a loaded file for scanning; `src` now belongs to the FileScan.
+static FileScan *file_scan_open(SrcFile *src, const char *rel) {
+  FileScan *fs = (FileScan *)xmalloc(sizeof(FileScan));
+  fs->src = src;
+  char *text = src->data;
+  size_t text_len = src->len;
+
+  // Line starts are indexed once so that line numbers and snippet slicing are
+  // binary searches instead of rescans from byte 0.
+  line_index_build(&fs->lines, text, text_len);
+
+  // Annotations live in comments, so record them before the comments are
+  // blanked. Stripping keeps offsets, so one buffer serves every pass below.
+  annotations_scan(&fs->anns, text, text_len, &fs->lines);
+  strip_comments(text, text_len);
+
+  fs->file = intern_str(rel);
+  fs->default_backend = intern_str(default_backend_for_path(rel));
+  fs->default_vis = default_visibility_for_path(rel);
+
+  // Every brace is matched once up front; block skips are then table hops.
+  brace_table_build(&fs->braces, text, text_len);
+  return fs;
+}
+
+// Scan [lo, hi) of an opened file, appending its symbols to `out`. Chunks of
+// one file may be scanned concurrently: everything shared is read-only and
+// offsets are absolute, so line numbers need no rebasing.
+static void file_scan_range(const FileScan *fs, size_t lo, size_t hi,
+                            SymVec *out) {
+  ScanCtx cx = {fs->src,
+                fs->src->data,
+                fs->src->len,
+                &fs->lines,
+                &fs->anns,
+                &fs->braces,
+                0,
+                fs->file,
+                fs->default_backend,
+                fs->default_vis,
+                out,
+                {0}};
+  mask_scan_init(&cx.masks, cx.text, cx.len);
+  scan_decls(&cx, lo, hi);
+}
+
+// Free the per-file tables. `out` holds the file's symbols from `first_sym`
+// on; snippets point into the buffer, so it lives as long as they do.
+static void file_scan_close(FileScan *fs, SymVec *out, size_t first_sym) {
+  g_stats.files++;
+  g_stats.files_mapped += fs->src->map_len != 0;
+  g_stats.lines += fs->lines.count;
+  g_stats.bytes += fs->src->len;
+  g_stats.symbols += out->len - first_sym;
+
+  brace_table_free(&fs->braces);
+  annotations_free(&fs->anns);
+  line_index_free(&fs->lines);
+  if (out->len > first_sym)
+    vec_own_file(out, fs->src);
+  else
+    src_free(fs->src);
+  free(fs);
+}
+
+// Files at least this large are split into chunks of about CHUNK_TARGET bytes
+// that pool workers scan concurrently.
+#define CHUNK_MIN_FILE (1024 * 1024)
+#define CHUNK_TARGET (256 * 1024)
+
+// Does the declaration from `start` up to the '{' at `brace` open an
+// extern "C" / namespace block, which scan_decl keeps at top level?
+static bool opens_scope(const char *s, size_t start, size_t brace) {
+  Lexer lx;
+  lex_init(&lx, s, start, brace);
+  lx.bol = start == 0 || s[start - 1] == '\n'; // else it follows ';' or '}'
+  Token t[3];
+  int n = 0;
+  for (Token u; (u = lex_next(&lx)).kind != TOK_EOF;) {
+    if (u.bol && tok_punct(s, u, '#')) {
+      lx.pos = directive_end(s, u.off, brace);
+      continue;
+    }
+    if (n == 2)
+      return false;
+    t[n++] = u;
   }
-  return NULL;
+  if (n == 0 ||
+      !(tok_word(s, t[0], "extern") || tok_word(s, t[0], "namespace")))
+    return false;
+  return n == 1 || t[1].kind == TOK_IDENT ||
+         (t[1].kind == TOK_OTHER && s[t[1].off] == '"');
 }
 
-static void add_deps_closure(const SymVec *syms, const StrSet *type_names,
-                             StrSet *selected) {
-  // Fixed-point: if selected symbol's snippet mentions other API type names,
-  // select them too. This covers Player -> Vec2, and fn signatures -> types.
-  bool changed = true;
-  while (changed) {
-    changed = false;
-    for (size_t i = 0; i < syms->len; i++) {
-      const Symbol *s = &syms->data[i];
-      if (!set_has(selected, s->name))
+// Pick chunk boundaries for file_scan_range: offsets just past a ';' that
+// ends a top-level declaration (outside braces other than extern "C" and
+// namespace blocks, literals and directives), about `target` bytes apart.
+// Between such points the serial scan carries no state, so scanning the
+// chunks separately yields the same symbols. Returns the number of chunks;
+// (*bounds)[0..n] are their edges.
+static size_t find_chunk_bounds(const FileScan *fs, size_t target,
+                                size_t **bounds) {
+  const char *s = fs->src->data;
+  size_t n = fs->src->len;
+  size_t cap = n / target + 2, nb = 0;
+  size_t *b = (size_t *)xmalloc(cap * sizeof(size_t));
+  b[nb++] = 0;
+
+  MaskScan ms;
+  mask_scan_init(&ms, s, n);
+  size_t cursor = 0, decl_start = 0, next_cut = target;
+  bool after_block = false;
+  const unsigned stops =
+      CLS(CLS_SEMI) | CLS(CLS_BRACE) | CLS(CLS_HASH) | CLS(CLS_QUOTE);
+  for (size_t i = 0; (i = mask_next(&ms, i, stops)) < n;) {
+    char c = s[i];
+    if (c == '#') {
+      size_t k = i;
+      while (k > 0 && s[k - 1] != '\n' && isspace((unsigned char)s[k - 1]))
+        k--;
+      i = (k == 0 || s[k - 1] == '\n') ? directive_end(s, i, n) : i + 1;
+    } else if (c == '"' || c == '\'') {
+      Lexer lx;
+      lex_init(&lx, s, i, n);
+      lex_next(&lx);
+      i = lx.pos;
+    } else if (c == '{') {
+      if (!after_block && opens_scope(s, decl_start, i)) {
+        decl_start = ++i;
         continue;
-
-      // Collect identifiers from signature/snippet (cheap)
-      StrSet ids;
-      set_init(&ids, 1024);
-      if (s->sigline)
-        collect_idents_from_text(s->sigline, &ids);
-      collect_idents_from_text(s->snippet, &ids);
-
-      // For every type name identifier present, add it
-      for (size_t b = 0; b < ids.cap; b++) {
-        if (!ids.keys[b])
-          continue;
-        const char *id = ids.keys[b];
-        if (set_has(type_names, id) && !set_has(selected, id)) {
-          set_add(selected, id);
-          changed = true;
+      }
+      // past a body the scanner runs on to the ';', so nothing before it
+      // starts a declaration
+      i = brace_table_close(&fs->braces, &cursor, i, n);
+      after_block = true;
+    } else if (c == '}') {
+      if (!after_block)
+        decl_start = i + 1; // closes an extern "C" / namespace block
+      i++;
+    } else { // ';'
+      decl_start = ++i;
+      after_block = false;
+      if (i >= next_cut && i < n) {
+        if (nb == cap) {
+          cap *= 2;
+          b = (size_t *)xrealloc(b, cap * sizeof(size_t));
         }
+        b[nb++] = i;
+        next_cut = i + target;
       }
-      set_free(&ids);
     }
   }
+  if (nb == cap)
+    b = (size_t *)xrealloc(b, (cap + 1) * sizeof(size_t));
+  b[nb] = n;
+  *bounds = b;
+  return nb;
 }
 
-static Visibility vis_from_arg(const char *s) {
-  if (!s || strcmp(s, "public") == 0)
-    return VIS_PUBLIC;
-  if (strcmp(s, "private") == 0)
-    return VIS_PRIVATE; // means "private view" (include priv too)
-  return VIS_PUBLIC;
-}
+/* =======================
+   Scan cache
+   ======================= */
 
-static void emit_auto_import(const char *out_path, const SymVec *syms,
-                             const char *entry_text,
-                             const char *vis_mode /* "public"|"private" */) {
+// The symbols of every file are kept between runs in a cache file (by
+// default <root>/.api_tool_cache). A file whose (dev, inode, size, mtime,
+// ctime) still match its record is not opened at all: its symbols, snippets
+// included, come from the record. When only the stat identity changed (a
+// checkout that rewrites mtimes, a copy), the file is read and hashed, and
+// an unchanged content hash still takes the symbols from the record.
+//
+// A matching stat identity proves nothing for a file modified around the
+// time it was scanned: a second edit within the same timestamp tick keeps
+// its mtime and ctime. As git does for its index, the cache records when it
+// was written (as the start of the scan that wrote it, less
+// CACHE_STAMP_SLACK_NS) and a record whose mtime is not strictly older is
+// "racily clean": its file is read and hashed like a changed one. The
+// rewritten record keeps that mtime, so it is only trusted once a later
+// cache is written well after it.
+//
+// After an 8-byte magic, which changes whenever the scanner's output does,
+// and the u64 write time in ns, records follow in path order:
+//
+//   u32 path_len, path, FileKey, u64 content_hash, u64 body_len, body
+//   body: u32 nsyms, u64 blob_len,
+//         nsyms * { u8 kind, u8 vis, i32 line_start, i32 line_end,
+//                   u32 len + name, u32 len + backend,
+//                   u32 len + sigline (CACHE_NO_SIG: none), u64 snippet_len },
+//         blob: the snippets, back to back
+//
+// Integers are in host byte order; the cache is not meant to travel.
 
-  // Build name sets
-  StrSet all_names, type_names, fn_names;
-  build_api_name_sets(syms, &all_names, &type_names, &fn_names);
+#define CACHE_MAGIC "APIC0005"
+#define CACHE_NO_SIG UINT32_MAX
+// How far a file's mtime may trail the clock when it is written: a tick of
+// the kernel's coarse clock, or the 2 s resolution of FAT.
+#define CACHE_STAMP_SLACK_NS 2000000000ull
 
-  // Collect identifiers used in entry_text
-  StrSet used;
-  set_init(&used, 4096);
-  collect_idents_from_text(entry_text, &used);
+typedef struct {
+  uint64_t dev, ino, size, mtime_ns, ctime_ns;
+} FileKey;
+
+// XXH64 with seed 0: four independent multiply-rotate lanes over 32-byte
+// stripes, which keeps up with memory bandwidth, so hashing a file costs
+// about as much as reading it.
+#define XXH_P1 0x9E3779B185EBCA87ull
+#define XXH_P2 0xC2B2AE3D27D4EB4Full
+#define XXH_P3 0x165667B19E3779F9ull
+#define XXH_P4 0x85EBCA77C2B2AE63ull
+#define XXH_P5 0x27D4EB2F165667C5ull
+
+static uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static uint64_t load64(const unsigned char *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
 
-  // Selected imports: intersection(used, api_names), respecting vis_mode
-  StrSet selected;
-  set_init(&selected, 4096);
+static uint32_t load32(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
 
-  bool include_private = (vis_mode && strcmp(vis_mode, "private") == 0);
+static uint64_t xxh_round(uint64_t acc, uint64_t in) {
+  return rotl64(acc + in * XXH_P2, 31) * XXH_P1;
+}
 
-  for (size_t i = 0; i < syms->len; i++) {
-    const Symbol *sym = &syms->data[i];
+static uint64_t xxh_merge(uint64_t h, uint64_t acc) {
+  return (h ^ xxh_round(0, acc)) * XXH_P1 + XXH_P4;
+}
+
+static uint64_t content_hash(const void *data, size_t n) {
+  const unsigned char *p = (const unsigned char *)data, *end = p + n;
+  uint64_t h;
+  if (n >= 32) {
+    uint64_t v1 = XXH_P1 + XXH_P2, v2 = XXH_P2, v3 = 0, v4 = 0 - XXH_P1;
+    for (; end - p >= 32; p += 32) {
+      v1 = xxh_round(v1, load64(p));
+      v2 = xxh_round(v2, load64(p + 8));
+      v3 = xxh_round(v3, load64(p + 16));
+      v4 = xxh_round(v4, load64(p + 24));
+    }
+    h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+    h = xxh_merge(xxh_merge(xxh_merge(xxh_merge(h, v1), v2), v3), v4);
+  } else {
+    h = XXH_P5;
+  }
+  h += (uint64_t)n;
+  for (; end - p >= 8; p += 8)
+    h = rotl64(h ^ xxh_round(0, load64(p)), 27) * XXH_P1 + XXH_P4;
+  if (end - p >= 4) {
+    h = rotl64(h ^ (uint64_t)load32(p) * XXH_P1, 23) * XXH_P2 + XXH_P3;
+    p += 4;
+  }
+  for (; p < end; p++)
+    h = rotl64(h ^ *p * XXH_P5, 11) * XXH_P1;
+  h ^= h >> 33;
+  h *= XXH_P2;
+  h ^= h >> 29;
+  h *= XXH_P3;
+  h ^= h >> 32;
+  return h;
+}
+
+typedef struct {
+  const char *path; // not NUL-terminated; NULL marks an empty slot
+  uint32_t path_len;
+  FileKey key;
+  uint64_t hash;
+  const unsigned char *rec; // the whole record
+  size_t rec_len;
+  const unsigned char *body;
+  size_t body_len;
+} CacheEnt;
+
+// The previous run's cache, read-only while the scan runs.
+typedef struct {
+  SrcFile *file;
+  CacheEnt *slots; // open addressing on the path
+  size_t cap, len;
+  uint64_t written_ns; // records at or after this mtime are racily clean
+} ScanCache;
+
+static FileKey file_key(const struct stat *st) {
+  FileKey k = {(uint64_t)st->st_dev, (uint64_t)st->st_ino,
+               (uint64_t)st->st_size, 0, 0};
+#if defined(__APPLE__)
+  k.mtime_ns = (uint64_t)st->st_mtimespec.tv_sec * 1000000000u +
+               (uint64_t)st->st_mtimespec.tv_nsec;
+  k.ctime_ns = (uint64_t)st->st_ctimespec.tv_sec * 1000000000u +
+               (uint64_t)st->st_ctimespec.tv_nsec;
+#else
+  k.mtime_ns = (uint64_t)st->st_mtim.tv_sec * 1000000000u +
+               (uint64_t)st->st_mtim.tv_nsec;
+  k.ctime_ns = (uint64_t)st->st_ctim.tv_sec * 1000000000u +
+               (uint64_t)st->st_ctim.tv_nsec;
+#endif
+  return k;
+}
+
+// The write time for a cache built by a scan starting now. Every file is
+// read after this point, so an edit that went unseen gets an mtime of at
+// least the returned value.
+static uint64_t cache_stamp_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  uint64_t now = (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+  return now > CACHE_STAMP_SLACK_NS ? now - CACHE_STAMP_SLACK_NS : 0;
+}
+
+// Bounds-checked reader; a short read marks the cursor bad and yields 0.
+typedef struct {
+  const unsigned char *p, *end;
+  bool bad;
+} Cursor;
+
+static const unsigned char *cur_take(Cursor *c, size_t n) {
+  if (c->bad || (size_t)(c->end - c->p) < n) {
+    c->bad = true;
+    return NULL;
+  }
+  const unsigned char *at = c->p;
+  c->p += n;
+  return at;
+}
+
+static uint32_t cur_u32(Cursor *c) {
+  uint32_t v = 0;
+  const unsigned char *at = cur_take(c, sizeof(v));
+  if (at)
+    memcpy(&v, at, sizeof(v));
+  return v;
+}
+
+static uint64_t cur_u64(Cursor *c) {
+  uint64_t v = 0;
+  const unsigned char *at = cur_take(c, sizeof(v));
+  if (at)
+    memcpy(&v, at, sizeof(v));
+  return v;
+}
+
+static void buf_u32(Buf *b, uint32_t v) { buf_put(b, (const char *)&v, 4); }
+static void buf_u64(Buf *b, uint64_t v) { buf_put(b, (const char *)&v, 8); }
+
+static void buf_str32(Buf *b, const char *s) {
+  size_t n = strlen(s);
+  buf_u32(b, (uint32_t)n);
+  buf_put(b, s, n);
+}
+
+static void buf_key(Buf *b, const FileKey *k) {
+  buf_u64(b, k->dev);
+  buf_u64(b, k->ino);
+  buf_u64(b, k->size);
+  buf_u64(b, k->mtime_ns);
+  buf_u64(b, k->ctime_ns);
+}
+
+static CacheEnt *cache_slot(const ScanCache *sc, const char *path,
+                            size_t len) {
+  size_t mask = sc->cap - 1;
+  for (size_t i = hash_bytes(path, len) & mask;; i = (i + 1) & mask) {
+    CacheEnt *ce = &sc->slots[i];
+    if (!ce->path ||
+        (ce->path_len == len && memcmp(ce->path, path, len) == 0))
+      return ce;
+  }
+}
+
+static void cache_free(ScanCache *sc) {
+  if (!sc)
+    return;
+  src_free(sc->file);
+  free(sc->slots);
+  free(sc);
+}
+
+// NULL when there is no usable cache at `path`.
+static ScanCache *cache_load(const char *path) {
+  SrcFile *file = src_load_at(AT_FDCWD, path);
+  if (!file)
+    return NULL;
+  ScanCache *sc = (ScanCache *)xcalloc(1, sizeof(ScanCache));
+  sc->file = file;
+  Cursor c = {(const unsigned char *)file->data,
+              (const unsigned char *)file->data + file->len, false};
+  const unsigned char *magic = cur_take(&c, 8);
+  if (!magic || memcmp(magic, CACHE_MAGIC, 8) != 0) {
+    cache_free(sc);
+    return NULL;
+  }
+  sc->written_ns = cur_u64(&c);
+  if (c.bad) {
+    cache_free(sc);
+    return NULL;
+  }
+  size_t nrec = 0;
+  for (Cursor scan = c; scan.p < scan.end && !scan.bad; nrec++) {
+    uint32_t n = cur_u32(&scan);
+    cur_take(&scan, n + sizeof(FileKey) + sizeof(uint64_t));
+    cur_take(&scan, cur_u64(&scan));
+  }
+  sc->cap = 16;
+  while (sc->cap < nrec * 2)
+    sc->cap *= 2;
+  sc->slots = (CacheEnt *)xcalloc(sc->cap, sizeof(CacheEnt));
+
+  while (c.p < c.end) {
+    CacheEnt ce;
+    ce.rec = c.p;
+    ce.path_len = cur_u32(&c);
+    ce.path = (const char *)cur_take(&c, ce.path_len);
+    ce.key.dev = cur_u64(&c);
+    ce.key.ino = cur_u64(&c);
+    ce.key.size = cur_u64(&c);
+    ce.key.mtime_ns = cur_u64(&c);
+    ce.key.ctime_ns = cur_u64(&c);
+    ce.hash = cur_u64(&c);
+    ce.body_len = cur_u64(&c);
+    ce.body = cur_take(&c, ce.body_len);
+    if (c.bad) {
+      cache_free(sc);
+      return NULL;
+    }
+    ce.rec_len = (size_t)(c.p - ce.rec);
+    CacheEnt *slot = cache_slot(sc, ce.path, ce.path_len);
+    if (!slot->path)
+      sc->len++;
+    *slot = ce;
+  }
+  return sc;
+}
+
+// The record for `rel`, if there is one.
+static const CacheEnt *cache_find(const ScanCache *sc, const char *rel) {
+  if (!sc)
+    return NULL;
+  const CacheEnt *ce = cache_slot(sc, rel, strlen(rel));
+  return ce->path ? ce : NULL;
+}
+
+// Whether record `ce` may be used without reading the file: its stat
+// identity is unchanged and it is not racily clean.
+static bool cache_key_trusted(const ScanCache *sc, const CacheEnt *ce,
+                              const FileKey *key) {
+  return memcmp(&ce->key, key, sizeof(FileKey)) == 0 &&
+         ce->key.mtime_ns < sc->written_ns;
+}
+
+// Rebuild a file's symbols from its record. Their snippets point into one
+// buffer holding the record's blob. False if the record is damaged.
+static bool cache_read_syms(const CacheEnt *ce, StrId file, SymVec *out) {
+  Cursor c = {ce->body, ce->body + ce->body_len, false};
+  uint32_t nsyms = cur_u32(&c);
+  uint64_t blob_len = cur_u64(&c);
+  if (c.bad || blob_len > ce->body_len)
+    return false;
+  SrcFile *src = (SrcFile *)xmalloc(sizeof(SrcFile));
+  src->data = (char *)xmalloc((size_t)blob_len + 1);
+  src->len = (size_t)blob_len;
+  src->map_len = 0;
+
+  size_t first = out->len, off = 0;
+  for (uint32_t i = 0; i < nsyms && !c.bad; i++) {
+    Symbol sym = {0};
+    const unsigned char *kv = cur_take(&c, 2);
+    if (kv && (kv[0] > SYM_TYPEDEF_STRUCT || kv[1] > VIS_PUBLIC))
+      c.bad = true; // corrupt: a miss, like any other bad record
+    sym.kind = kv && !c.bad ? (SymKind)kv[0] : SYM_FN_PROTO;
+    sym.vis = kv && !c.bad ? (Visibility)kv[1] : VIS_PRIVATE;
+    sym.line_start = (int)cur_u32(&c);
+    sym.line_end = (int)cur_u32(&c);
+    uint32_t n = cur_u32(&c);
+    const unsigned char *s = cur_take(&c, n);
+    sym.name = s ? intern((const char *)s, n) : STR_NONE;
+    n = cur_u32(&c);
+    s = cur_take(&c, n);
+    sym.backend = s ? intern((const char *)s, n) : STR_NONE;
+    n = cur_u32(&c);
+    if (n != CACHE_NO_SIG) {
+      s = cur_take(&c, n);
+      if (s)
+        sym.sigline = xstrndup((const char *)s, n);
+    }
+    sym.file = file;
+    sym.src = src;
+    sym.snippet_off = off;
+    sym.snippet_len = (size_t)cur_u64(&c);
+    off += sym.snippet_len;
+    vec_push(out, sym);
+  }
+  const unsigned char *blob = cur_take(&c, (size_t)blob_len);
+  if (c.bad || off != blob_len) {
+    for (size_t i = first; i < out->len; i++)
+      free(out->data[i].sigline);
+    out->len = first;
+    src_free(src);
+    return false;
+  }
+  memcpy(src->data, blob, (size_t)blob_len);
+  src->data[blob_len] = 0;
+  if (nsyms)
+    vec_own_file(out, src);
+  else
+    src_free(src);
+  return true;
+}
+
+// Serialize a freshly scanned file into `b`.
+static void cache_record(Buf *b, const char *rel, const FileKey *key,
+                         uint64_t hash, const SymVec *syms) {
+  buf_str32(b, rel);
+  buf_key(b, key);
+  buf_u64(b, hash);
+  size_t body_at = b->len;
+  buf_u64(b, 0); // body_len, patched below
+  size_t body_start = b->len;
+  uint64_t blob_len = 0;
+  for (size_t i = 0; i < syms->len; i++)
+    blob_len += syms->data[i].snippet_len;
+  buf_u32(b, (uint32_t)syms->len);
+  buf_u64(b, blob_len);
+  for (size_t i = 0; i < syms->len; i++) {
+    const Symbol *s = &syms->data[i];
+    unsigned char kv[2] = {(unsigned char)s->kind, (unsigned char)s->vis};
+    buf_put(b, (const char *)kv, 2);
+    buf_u32(b, (uint32_t)s->line_start);
+    buf_u32(b, (uint32_t)s->line_end);
+    buf_str32(b, str_of(s->name));
+    buf_str32(b, str_of(s->backend));
+    if (s->sigline)
+      buf_str32(b, s->sigline);
+    else
+      buf_u32(b, CACHE_NO_SIG);
+    buf_u64(b, s->snippet_len);
+  }
+  for (size_t i = 0; i < syms->len; i++) {
+    const Symbol *s = &syms->data[i];
+    buf_put(b, s->src->data + s->snippet_off, s->snippet_len);
+  }
+  uint64_t body_len = b->len - body_start;
+  memcpy(b->data + body_at, &body_len, sizeof(body_len));
+}
+
+// Copy record `ce` into `b` under a new stat identity, for a file whose
+// content hash shows it did not change.
+static void cache_rekey(Buf *b, const CacheEnt *ce, const FileKey *key) {
+  buf_u32(b, ce->path_len);
+  buf_put(b, ce->path, ce->path_len);
+  buf_key(b, key);
+  buf_u64(b, ce->hash);
+  buf_u64(b, ce->body_len);
+  buf_put(b, (const char *)ce->body, ce->body_len);
+}
+
+// Writes the next cache as files come out of the scan, in path order. Only
+// once something differs from the previous cache (a record was rebuilt, or
+// a file disappeared) is the file written; records taken unchanged before
+// that point are remembered as spans of the old cache until then.
+typedef struct {
+  const char *path;
+  const ScanCache *old;
+  uint64_t written_ns; // for the header, from cache_stamp_now()
+  char *tmp;
+  FILE *f;  // NULL until the first difference
+  struct {
+    const unsigned char *p;
+    size_t n;
+  } *held;
+  size_t nheld, held_cap;
+  size_t reused; // records taken unchanged
+  bool failed;
+  int err; // errno of the failure, 0 if it was a short write
+} CacheWriter;
+
+static void cache_writer_open(CacheWriter *cw) {
+  size_t n = strlen(cw->path) + 32;
+  cw->tmp = (char *)xmalloc(n);
+  snprintf(cw->tmp, n, "%s.tmp.%ld", cw->path, (long)getpid());
+  cw->f = fopen(cw->tmp, "wb");
+  if (!cw->f) {
+    cw->failed = true;
+    cw->err = errno;
+    return;
+  }
+  fwrite(CACHE_MAGIC, 1, 8, cw->f);
+  fwrite(&cw->written_ns, sizeof(cw->written_ns), 1, cw->f);
+  for (size_t i = 0; i < cw->nheld; i++)
+    fwrite(cw->held[i].p, 1, cw->held[i].n, cw->f);
+  free(cw->held);
+  cw->held = NULL;
+  cw->nheld = cw->held_cap = 0;
+}
+
+// Add one record: `old_rec` when the file was served from the cache, else
+// the freshly built `fresh`.
+static void cache_writer_add(CacheWriter *cw, const CacheEnt *old_rec,
+                             const Buf *fresh) {
+  if (cw->failed)
+    return;
+  if (old_rec) {
+    cw->reused++;
+    if (!cw->f) {
+      if (cw->nheld == cw->held_cap) {
+        cw->held_cap = cw->held_cap ? cw->held_cap * 2 : 256;
+        cw->held = xrealloc(cw->held, cw->held_cap * sizeof(*cw->held));
+      }
+      cw->held[cw->nheld].p = old_rec->rec;
+      cw->held[cw->nheld++].n = old_rec->rec_len;
+      return;
+    }
+    fwrite(old_rec->rec, 1, old_rec->rec_len, cw->f);
+    return;
+  }
+  if (!cw->f)
+    cache_writer_open(cw);
+  if (cw->f)
+    fwrite(fresh->data, 1, fresh->len, cw->f);
+}
+
+static void cache_writer_finish(CacheWriter *cw) {
+  if (!cw->f && !cw->failed && (!cw->old || cw->reused != cw->old->len))
+    cache_writer_open(cw); // files went away (or there was no cache)
+  if (cw->f) {
+    bool ok = fclose(cw->f) == 0 && !cw->failed;
+    if (ok && rename(cw->tmp, cw->path) != 0) {
+      ok = false;
+      cw->err = errno;
+    }
+    if (!ok) {
+      unlink(cw->tmp);
+      cw->failed = true;
+    }
+  }
+  // A read-only checkout simply goes uncached.
+  if (cw->failed && cw->err != EACCES && cw->err != EROFS &&
+      cw->err != EPERM)
+    fprintf(stderr, "warning: could not write scan cache %s\n", cw->path);
+  free(cw->tmp);
+  free(cw->held);
+}
+
+/* =======================
+   Tree scan
+   ======================= */
+
+// Directories stay open while files inside them wait to be scanned, so the
+// scanners can openat() relative to them. The traversal holds one reference
+// and every queued file another; the last one out closes the directory.
+typedef struct {
+  DIR *d;
+  atomic_int refs;
+} DirRef;
+
+static void dir_ref_put(DirRef *dr) {
+  if (atomic_fetch_sub(&dr->refs, 1) == 1) {
+    closedir(dr->d);
+    free(dr);
+  }
+}
+
+// A source file found by the traversal, and the symbols scanned from it.
+typedef struct {
+  DirRef *dir;
+  char *name; // points into rel
+  char *rel;  // path relative to the scan root
+  SymVec syms;
+  Buf *parts; // rendered by the workers, one per scanned range
+  size_t nparts;
+  FileKey key;
+  uint64_t hash;            // of the content, when the file was read
+  bool have_key;            // stat worked and the file could be read
+  const CacheEnt *cached;   // the record the symbols came from, if any
+  Buf rec;                  // else the new record for the cache
+  bool done; // guarded by TreeScan.lock
+} FileEnt;
+
+// A large file being scanned as chunks. Each chunk collects its own symbols;
+// whichever worker finishes the last chunk appends them in chunk order.
+typedef struct {
+  FileScan *fs;
+  FileEnt *fe;
+  size_t nchunks;
+  size_t *bounds; // chunk i is [bounds[i], bounds[i + 1])
+  SymVec *outs;
+  Buf *parts;
+  atomic_size_t remaining;
+} SplitScan;
+
+typedef struct {
+  SplitScan *split;
+  size_t index;
+} ChunkRef;
+
+// Task ids with this bit set name a chunk, the rest a file.
+#define CHUNK_TASK ((size_t)1 << (sizeof(size_t) * 8 - 1))
+
+// Files handed out by the traversal but not yet taken by the consumer. This
+// bounds everything held in memory at once: source buffers, symbols and
+// open directories.
+#define SCAN_WINDOW 256
+
+// Run by the worker that scanned a range of a file (the whole file, or one
+// chunk of a split one) to turn its symbols into output bytes in parallel.
+typedef void (*RangeRender)(void *arg, const SymVec *syms, Buf *out);
+
+// Handed back file by file, in path order, while the scan goes on, with the
+// rendered parts in range order (none without a RangeRender). The callee
+// takes over the symbols, the source buffers they point into and the parts.
+typedef void (*FileSink)(void *arg, SymVec *file_syms, Buf *parts,
+                         size_t nparts);
+
+// The traversal thread numbers files in path order and injects them into
+// the pool; the consumer takes them back in that order as they complete.
+// File `id` lives in window[id % SCAN_WINDOW] until it is consumed.
+typedef struct {
+  Pool *pool;
+  pthread_mutex_t lock;
+  pthread_cond_t ready; // a file completed or the traversal ended
+  pthread_cond_t room;  // the consumer freed a window slot
+  FileEnt *window[SCAN_WINDOW];
+  size_t nfiles;  // ids handed out
+  size_t next;    // first id not yet consumed
+  bool walk_done;
+  ChunkRef *chunks;
+  size_t nchunks, chunks_cap;
+  RangeRender render; // or NULL
+  void *render_arg;
+  const ScanCache *cache; // previous run's records, or NULL
+  bool records;           // build records for a new cache
+} TreeScan;
+
+static bool skip_dir_name(const char *name) {
+  return strcmp(name, ".git") == 0 || strcmp(name, "build") == 0 ||
+         strcmp(name, "dist") == 0 || strcmp(name, "out") == 0 ||
+         strcmp(name, ".cache") == 0 || strcmp(name, ".vscode") == 0;
+}
+
+static void queue_file(TreeScan *ts, DirRef *dr, const char *rel_dir,
+                       const char *name) {
+  FileEnt *fe = (FileEnt *)xcalloc(1, sizeof(FileEnt));
+  fe->rel = path_join(rel_dir, name);
+  fe->name = fe->rel + strlen(fe->rel) - strlen(name);
+  fe->dir = dr;
+  atomic_fetch_add(&dr->refs, 1);
+
+  pthread_mutex_lock(&ts->lock);
+  while (ts->nfiles - ts->next == SCAN_WINDOW)
+    pthread_cond_wait(&ts->room, &ts->lock);
+  size_t id = ts->nfiles++;
+  ts->window[id % SCAN_WINDOW] = fe;
+  pthread_mutex_unlock(&ts->lock);
+  pool_inject(ts->pool, id);
+}
+
+// The file's symbols are final: render them (unless its chunks already
+// were), record them for the cache and hand the file to the consumer.
+static void file_done(TreeScan *ts, FileEnt *fe) {
+  if (ts->render && !fe->parts) {
+    fe->parts = (Buf *)xcalloc(1, sizeof(Buf));
+    fe->nparts = 1;
+    ts->render(ts->render_arg, &fe->syms, fe->parts);
+  }
+  if (ts->records && fe->have_key && !fe->cached && !fe->rec.len)
+    cache_record(&fe->rec, fe->rel, &fe->key, fe->hash, &fe->syms);
+
+  pthread_mutex_lock(&ts->lock);
+  fe->done = true;
+  pthread_cond_signal(&ts->ready);
+  pthread_mutex_unlock(&ts->lock);
+}
+
+typedef struct {
+  char *name;
+  unsigned char type; // DT_DIR or DT_REG
+} WalkEnt;
+
+// Name order, with a directory sorting as if its name ended in '/': visiting
+// siblings in this order yields every file in strcmp order of its full path.
+static int cmp_walk_ent(const void *a, const void *b) {
+  const WalkEnt *x = (const WalkEnt *)a, *y = (const WalkEnt *)b;
+  const unsigned char *p = (const unsigned char *)x->name;
+  const unsigned char *q = (const unsigned char *)y->name;
+  while (*p && *p == *q)
+    p++, q++;
+  int cp = *p ? *p : x->type == DT_DIR ? '/' : 0;
+  int cq = *q ? *q : y->type == DT_DIR ? '/' : 0;
+  return cp - cq;
+}
+
+// Walk the directory open as `fd` (consumed), trusting d_type and calling
+// fstatat only when it is DT_UNKNOWN or a symlink (stat semantics, as
+// before). Entries are visited in sorted order, so files are queued in path
+// order and the consumer never waits on the end of the traversal.
+static void walk_dir(TreeScan *ts, int fd, const char *rel_dir) {
+  DIR *d = fdopendir(fd);
+  if (!d) {
+    close(fd);
+    return;
+  }
+  DirRef *dr = (DirRef *)xmalloc(sizeof(DirRef));
+  dr->d = d;
+  atomic_init(&dr->refs, 1);
+
+  WalkEnt *ents = NULL;
+  size_t n = 0, cap = 0;
+  struct dirent *ent;
+  while ((ent = readdir(d)) != NULL) {
+    const char *name = ent->d_name;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+      continue;
+    if (skip_dir_name(name))
+      continue;
+
+    unsigned char type = ent->d_type;
+    if (type == DT_UNKNOWN || type == DT_LNK) {
+      struct stat st;
+      if (fstatat(dirfd(d), name, &st, 0) != 0)
+        continue;
+      type = S_ISDIR(st.st_mode) ? DT_DIR
+             : S_ISREG(st.st_mode) ? DT_REG
+                                   : DT_UNKNOWN;
+    }
+    if (type != DT_DIR && !(type == DT_REG && has_c_ext(name)))
+      continue;
+    if (n == cap) {
+      cap = cap ? cap * 2 : 32;
+      ents = (WalkEnt *)xrealloc(ents, cap * sizeof(WalkEnt));
+    }
+    ents[n++] = (WalkEnt){xstrdup(name), type};
+  }
+  qsort(ents, n, sizeof(WalkEnt), cmp_walk_ent);
+
+  for (size_t i = 0; i < n; i++) {
+    const char *name = ents[i].name;
+    if (ents[i].type == DT_DIR) {
+      int child = openat(dirfd(d), name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (child >= 0) {
+        char *rel = path_join(rel_dir, name);
+        walk_dir(ts, child, rel);
+        free(rel);
+      }
+    } else {
+      queue_file(ts, dr, rel_dir, name);
+    }
+    free(ents[i].name);
+  }
+  free(ents);
+  dir_ref_put(dr);
+}
+
+typedef struct {
+  TreeScan *ts;
+  const char *root;
+} WalkArgs;
+
+static void *walk_thread_main(void *argp) {
+  WalkArgs *wa = (WalkArgs *)argp;
+  int fd = open(wa->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd >= 0)
+    walk_dir(wa->ts, fd, "");
+  pthread_mutex_lock(&wa->ts->lock);
+  wa->ts->walk_done = true;
+  pthread_cond_signal(&wa->ts->ready);
+  pthread_mutex_unlock(&wa->ts->lock);
+  pool_release(wa->ts->pool);
+  stats_flush();
+  return NULL;
+}
+
+static void chunk_done(TreeScan *ts, SplitScan *sp) {
+  if (atomic_fetch_sub(&sp->remaining, 1) != 1)
+    return;
+  FileEnt *fe = sp->fe;
+  for (size_t i = 0; i < sp->nchunks; i++) {
+    for (size_t k = 0; k < sp->outs[i].len; k++)
+      vec_push(&fe->syms, sp->outs[i].data[k]);
+    free(sp->outs[i].data);
+  }
+  file_scan_close(sp->fs, &fe->syms, 0);
+  if (ts->render) {
+    fe->parts = sp->parts;
+    fe->nparts = sp->nchunks;
+  }
+  free(sp->outs);
+  free(sp->bounds);
+  free(sp);
+  file_done(ts, fe);
+}
+
+static void scan_chunk(TreeScan *ts, size_t id) {
+  pthread_mutex_lock(&ts->lock);
+  ChunkRef cr = ts->chunks[id];
+  pthread_mutex_unlock(&ts->lock);
+  SplitScan *sp = cr.split;
+  file_scan_range(sp->fs, sp->bounds[cr.index], sp->bounds[cr.index + 1],
+                  &sp->outs[cr.index]);
+  if (ts->render)
+    ts->render(ts->render_arg, &sp->outs[cr.index], &sp->parts[cr.index]);
+  chunk_done(ts, sp);
+}
+
+// Queue chunks 1.. of a split file on our own deque, where idle workers can
+// steal them, and scan chunk 0 here.
+static void scan_split(TreeScan *ts, FileScan *fs, FileEnt *fe, size_t *bounds,
+                       size_t nchunks, int worker) {
+  SplitScan *sp = (SplitScan *)xmalloc(sizeof(SplitScan));
+  sp->fs = fs;
+  sp->fe = fe;
+  sp->nchunks = nchunks;
+  sp->bounds = bounds;
+  sp->outs = (SymVec *)xcalloc(nchunks, sizeof(SymVec));
+  sp->parts = ts->render ? (Buf *)xcalloc(nchunks, sizeof(Buf)) : NULL;
+  atomic_init(&sp->remaining, nchunks);
+
+  pthread_mutex_lock(&ts->lock);
+  size_t first = ts->nchunks;
+  if (ts->nchunks + nchunks > ts->chunks_cap) {
+    while (ts->nchunks + nchunks > ts->chunks_cap)
+      ts->chunks_cap = ts->chunks_cap ? ts->chunks_cap * 2 : 64;
+    ts->chunks =
+        (ChunkRef *)xrealloc(ts->chunks, ts->chunks_cap * sizeof(ChunkRef));
+  }
+  for (size_t i = 0; i < nchunks; i++)
+    ts->chunks[ts->nchunks++] = (ChunkRef){sp, i};
+  pthread_mutex_unlock(&ts->lock);
+
+  for (size_t i = nchunks; i > 1; i--) // popped from the back, so in order
+    pool_push(ts->pool, worker, CHUNK_TASK | (first + i - 1));
+  scan_chunk(ts, first);
+}
+
+static void scan_task(void *arg, size_t task, int worker) {
+  TreeScan *ts = (TreeScan *)arg;
+  size_t allocs_before = g_stats.allocs + g_stats.reallocs;
+  if (task & CHUNK_TASK) {
+    scan_chunk(ts, task & ~CHUNK_TASK);
+  } else {
+    pthread_mutex_lock(&ts->lock);
+    FileEnt *fe = ts->window[task % SCAN_WINDOW];
+    pthread_mutex_unlock(&ts->lock);
+
+    int dfd = dirfd(fe->dir->d);
+    const CacheEnt *ce = NULL;
+    if (ts->records) {
+      struct stat st;
+      fe->have_key = fstatat(dfd, fe->name, &st, 0) == 0;
+      if (fe->have_key) {
+        fe->key = file_key(&st);
+        ce = cache_find(ts->cache, fe->rel);
+      }
+      if (ce && cache_key_trusted(ts->cache, ce, &fe->key) &&
+          cache_read_syms(ce, intern_str(fe->rel), &fe->syms)) {
+        dir_ref_put(fe->dir);
+        fe->dir = NULL;
+        fe->cached = ce;
+        g_stats.files_cached++;
+        g_stats.symbols += fe->syms.len;
+        file_done(ts, fe);
+        g_stats.scan_allocs +=
+            g_stats.allocs + g_stats.reallocs - allocs_before;
+        return;
+      }
+    }
+
+    SrcFile *src = src_load_at(dfd, fe->name);
+    dir_ref_put(fe->dir);
+    fe->dir = NULL;
+    if (src && ts->records) {
+      fe->hash = content_hash(src->data, src->len);
+      if (ce && ce->hash == fe->hash && ce->key.size == src->len &&
+          cache_read_syms(ce, intern_str(fe->rel), &fe->syms)) {
+        src_free(src);
+        cache_rekey(&fe->rec, ce, &fe->key);
+        g_stats.files_cached++;
+        g_stats.files_rehashed++;
+        g_stats.symbols += fe->syms.len;
+        file_done(ts, fe);
+        g_stats.scan_allocs +=
+            g_stats.allocs + g_stats.reallocs - allocs_before;
+        return;
+      }
+    }
+    FileScan *fs = src ? file_scan_open(src, fe->rel) : NULL;
+    if (!fs)
+      fe->have_key = false; // unreadable: leave it out of the cache
+
+    size_t *bounds = NULL, nchunks = 1;
+    if (fs && fs->src->len >= CHUNK_MIN_FILE && ts->pool->nworkers > 1)
+      nchunks = find_chunk_bounds(fs, CHUNK_TARGET, &bounds);
+    if (nchunks > 1) {
+      scan_split(ts, fs, fe, bounds, nchunks, worker);
+    } else {
+      free(bounds);
+      if (fs) {
+        file_scan_range(fs, 0, fs->src->len, &fe->syms);
+        file_scan_close(fs, &fe->syms, 0);
+      }
+      file_done(ts, fe);
+    }
+  }
+  g_stats.scan_allocs += g_stats.allocs + g_stats.reallocs - allocs_before;
+}
+
+static void *pool_thread_main(void *argp) {
+  pool_run((Pool *)argp);
+  stats_flush();
+  return NULL;
+}
+
+// Scan every C source under `root` with `jobs` threads, rendering each range
+// with `render` (if set) on the scanning worker, and hand each file's
+// symbols to `sink` on the calling thread, ordered by file path, then by
+// position in the file, for any `jobs`. Traversal, scanning and the sink
+// overlap: a traversal thread feeds the pool, and the sink gets a file as
+// soon as it and every file before it are done. At most SCAN_WINDOW files
+// are in flight, so memory does not grow with the tree. With `cache_path`,
+// unchanged files come from the scan cache there, which is then updated.
+static void scan_tree_each(const char *root, int jobs, const char *cache_path,
+                           RangeRender render, FileSink sink, void *arg) {
+  if (jobs < 1)
+    jobs = 1;
+  Pool pool;
+  TreeScan ts = {0};
+  ts.pool = &pool;
+  ts.render = render;
+  ts.render_arg = arg;
+  ScanCache *cache = cache_path ? cache_load(cache_path) : NULL;
+  CacheWriter cw = {cache_path, cache, cache_stamp_now(), NULL, NULL, NULL,
+                    0, 0, 0, false, 0};
+  ts.cache = cache;
+  ts.records = cache_path != NULL;
+  pthread_mutex_init(&ts.lock, NULL);
+  pthread_cond_init(&ts.ready, NULL);
+  pthread_cond_init(&ts.room, NULL);
+  pool_init(&pool, jobs, SCAN_WINDOW, scan_task, &ts);
+
+  WalkArgs wa = {&ts, root};
+  pthread_t walker, workers;
+  pool_hold(&pool); // released when the traversal finishes
+  if (pthread_create(&walker, NULL, walk_thread_main, &wa) != 0)
+    die("failed to start traversal thread");
+  if (pthread_create(&workers, NULL, pool_thread_main, &pool) != 0)
+    die("failed to start worker thread");
+
+  for (;;) {
+    pthread_mutex_lock(&ts.lock);
+    while (!(ts.next < ts.nfiles && ts.window[ts.next % SCAN_WINDOW]->done) &&
+           !(ts.walk_done && ts.next == ts.nfiles))
+      pthread_cond_wait(&ts.ready, &ts.lock);
+    FileEnt *fe =
+        ts.next < ts.nfiles ? ts.window[ts.next % SCAN_WINDOW] : NULL;
+    pthread_mutex_unlock(&ts.lock);
+    if (!fe)
+      break;
+
+    if (fe->cached || fe->rec.len)
+      cache_writer_add(&cw, fe->cached, &fe->rec);
+    free(fe->rec.data);
+    sink(arg, &fe->syms, fe->parts, fe->nparts);
+    free(fe->rel);
+    free(fe);
+    pthread_mutex_lock(&ts.lock);
+    ts.next++;
+    pthread_cond_signal(&ts.room);
+    pthread_mutex_unlock(&ts.lock);
+  }
+
+  pthread_join(walker, NULL);
+  pthread_join(workers, NULL);
+  pool_destroy(&pool);
+  pthread_mutex_destroy(&ts.lock);
+  pthread_cond_destroy(&ts.ready);
+  pthread_cond_destroy(&ts.room);
+  free(ts.chunks);
+  if (cache_path)
+    cache_writer_finish(&cw);
+  cache_free(cache);
+}
+
+static void collect_file(void *arg, SymVec *file_syms, Buf *parts,
+                         size_t nparts) {
+  (void)parts;
+  (void)nparts;
+  SymVec *syms = (SymVec *)arg;
+  if (syms->len + file_syms->len > syms->cap) {
+    syms->cap = syms->cap ? syms->cap : 128;
+    while (syms->len + file_syms->len > syms->cap)
+      syms->cap *= 2;
+    syms->data = (Symbol *)xrealloc(syms->data, syms->cap * sizeof(Symbol));
+  }
+  if (file_syms->len)
+    memcpy(syms->data + syms->len, file_syms->data,
+           file_syms->len * sizeof(Symbol));
+  syms->len += file_syms->len;
+  for (size_t i = 0; i < file_syms->nfiles; i++)
+    vec_own_file(syms, file_syms->files[i]);
+  free(file_syms->data);
+  free(file_syms->files);
+}
+
+// Scan the whole tree into `syms`, for commands that need every symbol.
+static void scan_tree(const char *root, int jobs, const char *cache_path,
+                      SymVec *syms) {
+  scan_tree_each(root, jobs, cache_path, NULL, collect_file, syms);
+}
+
+static void free_syms(SymVec *v) {
+  for (size_t i = 0; i < v->len; i++)
+    free(v->data[i].sigline);
+  free(v->data);
+  for (size_t i = 0; i < v->nfiles; i++)
+    src_free(v->files[i]);
+  free(v->files);
+  v->data = NULL;
+  v->files = NULL;
+  v->len = v->cap = 0;
+  v->nfiles = v->files_cap = 0;
+}
+
+// mkdir -p for the directory part of `path`; existing directories are fine.
+static void ensure_parent_dir(const char *path) {
+  char *dup = xstrdup(path);
+  char *last = strrchr(dup, '/');
+  if (last) {
+    *last = 0;
+    for (char *p = dup + 1; p <= last; p++) {
+      if (*p != '/' && *p != 0)
+        continue;
+      char saved = *p;
+      *p = 0;
+      mkdir(dup, 0755);
+      *p = saved;
+    }
+  }
+  free(dup);
+}
+
+/* =======================
+   Emit: index.json + api.def
+   ======================= */
+
+static bool starts_with(const char *s, const char *prefix) {
+  if (!prefix || !*prefix)
+    return true;
+  size_t n = strlen(prefix);
+  return strncmp(s, prefix, n) == 0;
+}
+
+// STR_NONE for either filter means no filter.
+static bool backend_allowed(StrId b, StrId allow_backend,
+                            StrId exclude_backend) {
+  if (b == exclude_backend) return false;
+
+  if (allow_backend == STR_NONE) return true; // no allow filter
+
+  // allow_backend means: allow that backend + "core"
+  if (b == g_core_id) return true;
+  return b == allow_backend;
+}
+
+// One api_index.json entry, with the separator in front of it; the writer
+// drops the ',' of the very first entry.
+static void index_json_symbol(Buf *b, const Symbol *s) {
+  buf_puts(b, ",\n  {\"kind\":");
+  json_escape_buf(b, kind_str(s->kind));
+  buf_puts(b, ",\"vis\":");
+  json_escape_buf(b, vis_str(s->vis));
+  buf_puts(b, ",\"name\":");
+  json_escape_buf(b, str_of(s->name));
+  buf_puts(b, ",\"file\":");
+  json_escape_buf(b, str_of(s->file));
+  int n = snprintf(buf_reserve(b, 64), 64,
+                   ",\"line_start\":%d,\"line_end\":%d", s->line_start,
+                   s->line_end);
+  b->len += (size_t)n;
+  buf_puts(b, ",\"backend\":");
+  json_escape_buf(b, str_of(s->backend));
+  buf_puts(b, ",\"snippet\":");
+  char *sn = sym_snippet(s);
+  json_escape_buf(b, sn);
+  free(sn);
+  buf_put(b, "}", 1);
+}
+
+static void emit_api_type(FILE *f, const Symbol *s) {
+  char *sn = sym_snippet(s);
+  const char *lb = strchr(sn, '{');
+  const char *rb = strrchr(sn, '}');
+  if (!lb || !rb || rb <= lb) {
+    free(sn);
+    return;
+  }
+
+  fprintf(f, "API_TYPE(%s, %s,\n", vis_str(s->vis), str_of(s->name));
+
+  const char *p = lb + 1;
+  while (p < rb) {
+    const char *e = strchr(p, '\n');
+    if (!e || e > rb)
+      e = rb;
+    const char *end = e;
+    while (end > p && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'))
+      end--;
+    fputs("  ", f);
+    fwrite(p, 1, (size_t)(end - p), f);
+    fputc('\n', f);
+    if (e == rb)
+      break;
+    p = e + 1;
+  }
+
+  fputs(")\n\n", f);
+  free(sn);
+}
+
+static void emit_api_fn(FILE *f, const Symbol *s) {
+  // Parse ret + name + args: find '(' then last identifier before it.
+  const char *sig = s->sigline;
+  const char *lp = strchr(sig, '(');
+  if (!lp)
+    return;
+
+  const char *q = lp;
+  while (q > sig && isspace((unsigned char)q[-1]))
+    q--;
+  while (q > sig && (isalnum((unsigned char)q[-1]) || q[-1] == '_'))
+    q--;
+  const char *start_id = q;
+
+  // return type is [sig..start_id)
+  size_t ret_len = (size_t)(start_id - sig);
+  while (ret_len > 0 && isspace((unsigned char)sig[ret_len - 1]))
+    ret_len--;
+
+  char *ret = (char *)xmalloc(ret_len + 1);
+  memcpy(ret, sig, ret_len);
+  ret[ret_len] = 0;
+
+  fprintf(f, "API_FN(%s, %s, %s, %s)\n", vis_str(s->vis), ret,
+          str_of(s->name), lp);
+
+  free(ret);
+}
+
+// An output that is replaced only when its content changes. Bytes are
+// compared against the existing file as they are produced and nothing is
+// written while they match. At the first difference the matched prefix and
+// everything after it go to a temp file next to the output, which is
+// renamed over it on close: an unchanged output keeps its mtime (so the
+// TUs that include it do not rebuild) and a changed one never appears
+// half-written.
+typedef struct {
+  const char *path;
+  const char *what; // for error messages
+  bool exists;
+  mode_t mode;
+  const unsigned char *old; // existing content, mapped
+  size_t old_len;
+  size_t same; // bytes of `old` matched so far
+  char *tmp;
+  int fd; // the temp file; -1 while the output still matches
+} OutFile;
+
+static void out_fail(const OutFile *of) {
+  fprintf(stderr, "error: failed to write %s output %s\n", of->what,
+          of->path);
+  exit(1);
+}
+
+static void out_put(OutFile *of, const void *data, size_t len) {
+  if (!write_full(of->fd, data, len))
+    out_fail(of);
+}
+
+static void out_open(OutFile *of, const char *path, const char *what) {
+  memset(of, 0, sizeof(*of));
+  of->path = path;
+  of->what = what;
+  of->fd = -1;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    of->exists = true;
+    of->mode = st.st_mode & 07777;
+    if (st.st_size > 0) {
+      void *m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (m != MAP_FAILED) {
+        madvise(m, (size_t)st.st_size, MADV_SEQUENTIAL);
+        of->old = (const unsigned char *)m;
+        of->old_len = (size_t)st.st_size;
+      } else {
+        of->exists = false; // unreadable: always rewrite
+      }
+    }
+  }
+  close(fd);
+}
+
+static void out_diverge(OutFile *of) {
+  size_t n = strlen(of->path) + 32;
+  of->tmp = (char *)xmalloc(n);
+  snprintf(of->tmp, n, "%s.tmp.%ld", of->path, (long)getpid());
+  of->fd = open(of->tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (of->fd < 0)
+    out_fail(of);
+  if (of->exists)
+    fchmod(of->fd, of->mode);
+  out_put(of, of->old, of->same);
+}
+
+static void out_write(OutFile *of, const void *data, size_t len) {
+  if (of->fd < 0) {
+    if (of->exists && len <= of->old_len - of->same &&
+        memcmp(of->old + of->same, data, len) == 0) {
+      of->same += len;
+      return;
+    }
+    out_diverge(of);
+  }
+  out_put(of, data, len);
+}
+
+// Finish the output; returns whether the file was (re)written.
+static bool out_close(OutFile *of) {
+  bool changed = of->fd >= 0 || !of->exists || of->same != of->old_len;
+  if (changed) {
+    if (of->fd < 0)
+      out_diverge(of);
+    if (close(of->fd) != 0 || rename(of->tmp, of->path) != 0) {
+      unlink(of->tmp);
+      out_fail(of);
+    }
+    free(of->tmp);
+  }
+  if (of->old)
+    munmap((void *)of->old, of->old_len);
+  return changed;
+}
+
+// Index parts queued for one writev: at most this many, or this many bytes.
+#define INDEX_IOV_MAX 64
+#define INDEX_FLUSH_BYTES (1024 * 1024)
+
+// gen writes both outputs while the tree is still being scanned. Index
+// entries are rendered to JSON by the scanning workers and written here in
+// order, many parts per writev; API_TYPE blocks go out as each file arrives.
+// The FUNCTIONS section follows every type in api.def, so it collects in
+// memory (one line per prototype) until the end.
+typedef struct {
+  OutFile index;
+  struct iovec iov[INDEX_IOV_MAX];
+  char *held[INDEX_IOV_MAX]; // buffers behind iov, freed once written
+  int niov;
+  size_t iov_bytes;
+  bool any_entry; // an entry was queued; later ones keep their ','
+  OutFile def_out;
+  FILE *def; // memory stream over def_buf: one file's types at a time
+  char *def_buf;
+  size_t def_len;
+  FILE *fns; // memory stream over fns_buf
+  char *fns_buf;
+  size_t fns_len;
+  const char *fn_prefix;
+  StrId allow_backend;
+  StrId exclude_backend;
+  bool index_changed, def_changed;
+} GenWriter;
+
+static void index_flush(GenWriter *gw) {
+  struct iovec *iov = gw->iov;
+  int n = gw->niov;
+  // Parts are compared one by one until the index differs from the old one.
+  while (n > 0 && gw->index.fd < 0) {
+    out_write(&gw->index, iov->iov_base, iov->iov_len);
+    iov++;
+    n--;
+  }
+  while (n > 0) {
+    ssize_t w = writev(gw->index.fd, iov, n);
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;
+      out_fail(&gw->index);
+    }
+    while (n > 0 && (size_t)w >= iov->iov_len) {
+      w -= (ssize_t)iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *)iov->iov_base + w;
+      iov->iov_len -= (size_t)w;
+    }
+  }
+  for (int i = 0; i < gw->niov; i++)
+    free(gw->held[i]);
+  gw->niov = 0;
+  gw->iov_bytes = 0;
+}
+
+// Queue `len` bytes at `data`; `owned` (or NULL) is freed after the write.
+static void index_queue(GenWriter *gw, const char *data, size_t len,
+                        char *owned) {
+  if (gw->niov == INDEX_IOV_MAX)
+    index_flush(gw);
+  gw->iov[gw->niov].iov_base = (void *)data;
+  gw->iov[gw->niov].iov_len = len;
+  gw->held[gw->niov++] = owned;
+  gw->iov_bytes += len;
+  if (gw->iov_bytes >= INDEX_FLUSH_BYTES)
+    index_flush(gw);
+}
+
+// Move what has been emitted to api.def so far to its output.
+static void def_drain(GenWriter *gw) {
+  fflush(gw->def);
+  out_write(&gw->def_out, gw->def_buf, gw->def_len);
+  rewind(gw->def);
+}
+
+static void gen_open(GenWriter *gw, const char *index_path,
+                     const char *def_path, const char *fn_prefix,
+                     StrId allow_backend, StrId exclude_backend) {
+  out_open(&gw->index, index_path, "index");
+  gw->niov = 0;
+  gw->iov_bytes = 0;
+  gw->any_entry = false;
+  out_open(&gw->def_out, def_path, "api.def");
+  gw->def_buf = NULL;
+  gw->def_len = 0;
+  gw->def = open_memstream(&gw->def_buf, &gw->def_len);
+  gw->fns_buf = NULL;
+  gw->fns_len = 0;
+  gw->fns = open_memstream(&gw->fns_buf, &gw->fns_len);
+  if (!gw->def || !gw->fns)
+    die("out of memory");
+  gw->fn_prefix = fn_prefix;
+  gw->allow_backend = allow_backend;
+  gw->exclude_backend = exclude_backend;
+
+  index_queue(gw, "[", 1, NULL);
+  fputs("/* AUTO-GENERATED: do not edit by hand */\n", gw->def);
+  fputs("/* Generated by api_tool.c */\n\n", gw->def);
+  fputs("/* TYPES */\n", gw->def);
+}
+
+// RangeRender: the index entries of a range, on a scanning worker.
+static void gen_render(void *arg, const SymVec *syms, Buf *out) {
+  (void)arg;
+  for (size_t i = 0; i < syms->len; i++)
+    index_json_symbol(out, &syms->data[i]);
+}
+
+// Queue one file's rendered index entries (`parts`, freed once written)
+// and write its types.
+static void gen_emit(GenWriter *gw, const SymVec *file_syms, Buf *parts,
+                     size_t nparts) {
+  for (size_t i = 0; i < nparts; i++) {
+    if (parts[i].len == 0) {
+      free(parts[i].data);
+      continue;
+    }
+    size_t skip = gw->any_entry ? 0 : 1; // the first entry has no ','
+    gw->any_entry = true;
+    index_queue(gw, parts[i].data + skip, parts[i].len - skip,
+                parts[i].data);
+  }
+  free(parts);
+
+  for (size_t i = 0; i < file_syms->len; i++) {
+    const Symbol *s = &file_syms->data[i];
+    if (!backend_allowed(s->backend, gw->allow_backend, gw->exclude_backend))
+      continue;
+    if (s->kind == SYM_TYPEDEF_STRUCT || s->kind == SYM_STRUCT)
+      emit_api_type(gw->def, s);
+    else if (s->kind == SYM_FN_PROTO && s->sigline &&
+             starts_with(str_of(s->name), gw->fn_prefix))
+      emit_api_fn(gw->fns, s);
+  }
+  def_drain(gw);
+}
+
+// FileSink: emit one file, then free it.
+static void gen_file(void *arg, SymVec *file_syms, Buf *parts,
+                     size_t nparts) {
+  gen_emit((GenWriter *)arg, file_syms, parts, nparts);
+  free_syms(file_syms);
+}
+
+// Emit symbols that are already in memory, in path order, file by file.
+static void gen_syms(GenWriter *gw, const SymVec *syms) {
+  for (size_t i = 0, j; i < syms->len; i = j) {
+    for (j = i + 1; j < syms->len && syms->data[j].file == syms->data[i].file;
+         j++)
+      ;
+    SymVec run = {0};
+    run.data = syms->data + i;
+    run.len = j - i;
+    Buf *part = (Buf *)xcalloc(1, sizeof(Buf));
+    gen_render(NULL, &run, part);
+    gen_emit(gw, &run, part, 1);
+  }
+}
+
+static void gen_close(GenWriter *gw) {
+  index_queue(gw, "\n]\n", 3, NULL);
+  index_flush(gw);
+  gw->index_changed = out_close(&gw->index);
+
+  fputs("/* FUNCTIONS (prototypes) */\n", gw->def);
+  def_drain(gw);
+  fclose(gw->def);
+  free(gw->def_buf);
+  fclose(gw->fns);
+  out_write(&gw->def_out, gw->fns_buf, gw->fns_len);
+  free(gw->fns_buf);
+  gw->def_changed = out_close(&gw->def_out);
+}
+
+/* =======================
+   SEARCH (direct scan)
+   ======================= */
+
+static bool contains_case(const char *hay, const char *needle) {
+  if (!needle || !*needle)
+    return true;
+  if (!hay)
+    return false;
+  size_t n = strlen(needle);
+  for (const char *p = hay; *p; p++) {
+    size_t i = 0;
+    while (i < n && p[i] &&
+           tolower((unsigned char)p[i]) == tolower((unsigned char)needle[i]))
+      i++;
+    if (i == n)
+      return true;
+  }
+  return false;
+}
+
+static bool kind_match(SymKind k, const char *kind_s) {
+  if (!kind_s)
+    return true;
+  if (strcmp(kind_s, "fn") == 0)
+    return k == SYM_FN_PROTO || k == SYM_FN_DEF;
+  if (strcmp(kind_s, "fn_proto") == 0)
+    return k == SYM_FN_PROTO;
+  if (strcmp(kind_s, "fn_def") == 0)
+    return k == SYM_FN_DEF;
+  if (strcmp(kind_s, "struct") == 0)
+    return k == SYM_STRUCT || k == SYM_TYPEDEF_STRUCT;
+  if (strcmp(kind_s, "typedef_struct") == 0)
+    return k == SYM_TYPEDEF_STRUCT;
+  return true;
+}
+
+static void do_search(const SymVec *syms, const char *kind_s, const char *name,
+                      const char *pattern) {
+  StrId name_id = name && *name ? intern_find(name, strlen(name)) : STR_NONE;
+  for (size_t i = 0; i < syms->len; i++) {
+    const Symbol *s = &syms->data[i];
+    if (!kind_match(s->kind, kind_s))
+      continue;
+    if (name && *name && s->name != name_id)
+      continue;
+    char *sn = sym_snippet(s);
+    if (pattern && *pattern) {
+      if (!contains_case(str_of(s->name), pattern) &&
+          !contains_case(sn, pattern)) {
+        free(sn);
+        continue;
+      }
+    }
+    printf("\n== %s/%s: %s  (%s:%d-%d) ==\n", vis_str(s->vis),
+           kind_str(s->kind), str_of(s->name), str_of(s->file), s->line_start,
+           s->line_end);
+    puts(sn);
+    free(sn);
+  }
+}
+
+/* =======================
+   NEEDS: auto-import generation
+   ======================= */
+
+// Next identifier in [*pp, end) that was ever interned, or STR_NONE once
+// the text runs out. Other identifiers cannot name a symbol.
+static StrId next_known_ident(const char **pp, const char *end) {
+  const char *p = *pp;
+  StrId id = STR_NONE;
+  while (p < end && id == STR_NONE) {
+    if (!is_ident_start((unsigned char)*p)) {
+      p++;
+      continue;
+    }
+    const char *s = p++;
+    while (p < end && is_ident_char((unsigned char)*p))
+      p++;
+    size_t n = (size_t)(p - s);
+    if (n < 256)
+      id = intern_find(s, n);
+  }
+  *pp = p;
+  return id;
+}
+
+static void collect_idents_from_text(const char *text, size_t len,
+                                     IdSet *idents) {
+  const char *p = text, *end = text + len;
+  StrId id;
+  while ((id = next_known_ident(&p, end)) != STR_NONE)
+    idset_add(idents, id);
+}
+
+static void build_api_name_sets(const SymVec *syms, size_t id_bound,
+                                IdSet *all_names, IdSet *type_names,
+                                IdSet *fn_names) {
+  idset_init(all_names, id_bound);
+  idset_init(type_names, id_bound);
+  idset_init(fn_names, id_bound);
+
+  for (size_t i = 0; i < syms->len; i++) {
+    const Symbol *s = &syms->data[i];
+    idset_add(all_names, s->name);
+    if (s->kind == SYM_FN_PROTO || s->kind == SYM_FN_DEF)
+      idset_add(fn_names, s->name);
+    if (s->kind == SYM_STRUCT || s->kind == SYM_TYPEDEF_STRUCT)
+      idset_add(type_names, s->name);
+  }
+}
+
+// Name sets shared by every entry of a needs run, and the type-reference
+// graph: the API types mentioned (in the snippet) by the symbols
+// called `n` are refs[ref_start[n] .. ref_start[n + 1]). Read-only once
+// built, so batch entries use it from several threads at once.
+typedef struct {
+  const SymVec *syms;
+  size_t id_bound;
+  IdSet all_names, type_names, fn_names;
+  size_t *ref_start; // id_bound + 1 entries
+  StrId *refs;
+  bool include_private;
+} NeedsIndex;
+
+// Symbols per reference-scanning task.
+#define REF_BLOCK 256
+
+// The type references of one block of symbols: symbol `first + k` has
+// ids[off[k] .. off[k + 1]), without duplicates.
+typedef struct {
+  StrId *ids;
+  size_t len, cap;
+  size_t off[REF_BLOCK + 1];
+} RefBlock;
+
+typedef struct {
+  const NeedsIndex *nx;
+  RefBlock *blocks;
+} RefScan;
+
+static void ref_block_add(RefBlock *rb, size_t from, StrId id) {
+  for (size_t i = from; i < rb->len; i++)
+    if (rb->ids[i] == id)
+      return;
+  if (rb->len == rb->cap) {
+    rb->cap = rb->cap ? rb->cap * 2 : 256;
+    rb->ids = (StrId *)xrealloc(rb->ids, rb->cap * sizeof(StrId));
+  }
+  rb->ids[rb->len++] = id;
+}
+
+static void ref_block_scan(RefBlock *rb, size_t from, const IdSet *types,
+                           const char *text, size_t len) {
+  const char *p = text, *end = text + len;
+  StrId id;
+  while ((id = next_known_ident(&p, end)) != STR_NONE)
+    if (idset_has(types, id))
+      ref_block_add(rb, from, id);
+}
+
+static void ref_task(void *arg, size_t task, int worker) {
+  (void)worker;
+  RefScan *rs = (RefScan *)arg;
+  const SymVec *syms = rs->nx->syms;
+  RefBlock *rb = &rs->blocks[task];
+  size_t first = task * REF_BLOCK;
+  size_t n = syms->len - first < REF_BLOCK ? syms->len - first : REF_BLOCK;
+  for (size_t k = 0; k < n; k++) {
+    const Symbol *s = &syms->data[first + k];
+    rb->off[k] = rb->len;
+    // The signature is normalized from text inside the snippet, so the
+    // snippet alone has every identifier either could mention.
+    ref_block_scan(rb, rb->off[k], &rs->nx->type_names,
+                   s->src->data + s->snippet_off, s->snippet_len);
+  }
+  rb->off[n] = rb->len;
+}
+
+// Tokenize every symbol once, `jobs` blocks at a time, and group the type
+// references by symbol name.
+static void build_type_refs(NeedsIndex *nx, int jobs) {
+  const SymVec *syms = nx->syms;
+  size_t nblocks = (syms->len + REF_BLOCK - 1) / REF_BLOCK;
+  RefScan rs = {nx, (RefBlock *)xcalloc(nblocks ? nblocks : 1,
+                                        sizeof(RefBlock))};
+  if ((size_t)jobs > nblocks)
+    jobs = nblocks ? (int)nblocks : 1;
+  Pool pool;
+  pool_init(&pool, jobs, nblocks ? nblocks : 1, ref_task, &rs);
+  for (size_t b = 0; b < nblocks; b++)
+    pool_inject(&pool, b);
+  pool_run(&pool);
+  pool_destroy(&pool);
+
+  nx->ref_start = (size_t *)xcalloc(nx->id_bound + 1, sizeof(size_t));
+  for (size_t i = 0; i < syms->len; i++) {
+    const RefBlock *rb = &rs.blocks[i / REF_BLOCK];
+    size_t k = i % REF_BLOCK;
+    nx->ref_start[syms->data[i].name + 1] += rb->off[k + 1] - rb->off[k];
+  }
+  for (size_t n = 0; n < nx->id_bound; n++)
+    nx->ref_start[n + 1] += nx->ref_start[n];
+  nx->refs = (StrId *)xmalloc((nx->ref_start[nx->id_bound] + 1) *
+                              sizeof(StrId));
+  size_t *fill = (size_t *)xmalloc(nx->id_bound * sizeof(size_t));
+  memcpy(fill, nx->ref_start, nx->id_bound * sizeof(size_t));
+  for (size_t i = 0; i < syms->len; i++) {
+    const RefBlock *rb = &rs.blocks[i / REF_BLOCK];
+    size_t k = i % REF_BLOCK;
+    size_t cnt = rb->off[k + 1] - rb->off[k];
+    if (cnt == 0)
+      continue;
+    memcpy(nx->refs + fill[syms->data[i].name], rb->ids + rb->off[k],
+           cnt * sizeof(StrId));
+    fill[syms->data[i].name] += cnt;
+  }
+  free(fill);
+  for (size_t b = 0; b < nblocks; b++)
+    free(rs.blocks[b].ids);
+  free(rs.blocks);
+}
+
+static void needs_index_build(NeedsIndex *nx, const SymVec *syms,
+                              const char *vis_mode /* "public"|"private" */,
+                              int jobs) {
+  nx->syms = syms;
+  intern_freeze(); // the tree is scanned; only lookups from here on
+  nx->id_bound = intern_id_bound();
+  build_api_name_sets(syms, nx->id_bound, &nx->all_names, &nx->type_names,
+                      &nx->fn_names);
+  build_type_refs(nx, jobs);
+  nx->include_private = (vis_mode && strcmp(vis_mode, "private") == 0);
+}
+
+static void needs_index_free(NeedsIndex *nx) {
+  idset_free(&nx->all_names);
+  idset_free(&nx->type_names);
+  idset_free(&nx->fn_names);
+  free(nx->ref_start);
+  free(nx->refs);
+}
+
+// If a selected symbol mentions other API type names, select them too. This
+// covers Player -> Vec2, and fn signatures -> types. Worklist over the
+// precomputed references: every name is expanded once, so the closure is
+// linear in the references it reaches. It stays serial: even a closure that
+// reaches every name of a 100k-symbol API takes about 2 ms, next to ~100 ms
+// for the scan and ~50 ms for the edges, and batch entries already run their
+// closures on the pool side by side. A parallel frontier would need atomic
+// set inserts and a barrier per level for no measurable gain.
+static void add_deps_closure(const NeedsIndex *nx, IdSet *selected) {
+  size_t len = 0, cap = 256;
+  StrId *work = (StrId *)xmalloc(cap * sizeof(StrId));
+  for (size_t w = 0; w < selected->nwords; w++) {
+    for (uint64_t bits = selected->bits[w]; bits; bits &= bits - 1) {
+      if (len == cap) {
+        cap *= 2;
+        work = (StrId *)xrealloc(work, cap * sizeof(StrId));
+      }
+      work[len++] = (StrId)(w * 64 + (size_t)__builtin_ctzll(bits));
+    }
+  }
+  while (len > 0) {
+    StrId n = work[--len];
+    for (size_t r = nx->ref_start[n]; r < nx->ref_start[n + 1]; r++) {
+      StrId t = nx->refs[r];
+      if (!idset_add(selected, t))
+        continue;
+      if (len == cap) {
+        cap *= 2;
+        work = (StrId *)xrealloc(work, cap * sizeof(StrId));
+      }
+      work[len++] = t;
+    }
+  }
+  free(work);
+}
+
+// Write the auto_import header for one entry. False (with a message on
+// stderr) if the output cannot be written.
+static bool emit_auto_import(const NeedsIndex *nx, const char *out_path,
+                             const char *entry_text) {
+  const SymVec *syms = nx->syms;
+  bool include_private = nx->include_private;
+
+  // Collect identifiers used in entry_text
+  IdSet used;
+  idset_init(&used, nx->id_bound);
+  collect_idents_from_text(entry_text, strlen(entry_text), &used);
+
+  // Selected imports: intersection(used, api_names), respecting vis_mode
+  IdSet selected;
+  idset_init(&selected, nx->id_bound);
+
+  for (size_t i = 0; i < syms->len; i++) {
+    const Symbol *sym = &syms->data[i];
 
     // Visibility filter:
     // - if public mode: only allow PUBLIC symbols
@@ -1201,18 +3917,23 @@ static void emit_auto_import(const char *out_path, const SymVec *syms,
     if (!include_private && sym->vis != VIS_PUBLIC)
       continue;
 
-    if (set_has(&used, sym->name)) {
-      set_add(&selected, sym->name);
+    if (idset_has(&used, sym->name)) {
+      idset_add(&selected, sym->name);
     }
   }
 
   // Dependency closure (types referenced by selected symbols)
-  add_deps_closure(syms, &type_names, &selected);
+  add_deps_closure(nx, &selected);
 
   ensure_parent_dir(out_path);
   FILE *f = fopen(out_path, "wb");
-  if (!f)
-    die("failed to open auto_import output");
+  if (!f) {
+    fprintf(stderr, "error: failed to open %s: %s\n", out_path,
+            strerror(errno));
+    idset_free(&selected);
+    idset_free(&used);
+    return false;
+  }
 
   fputs("#pragma once\n", f);
   fputs("#define API_SELECTIVE 1\n", f);
@@ -1225,60 +3946,572 @@ static void emit_auto_import(const char *out_path, const SymVec *syms,
   // Emit IMPORT_ macros
   for (size_t i = 0; i < syms->len; i++) {
     const Symbol *sym = &syms->data[i];
-    if (!set_has(&selected, sym->name))
+    if (!idset_has(&selected, sym->name))
+      continue;
+
+    // enforce visibility (again)
+    if (!include_private && sym->vis != VIS_PUBLIC)
       continue;
 
-    // enforce visibility (again)
-    if (!include_private && sym->vis != VIS_PUBLIC)
-      continue;
+    fprintf(f, "#define IMPORT_%s 1\n", str_of(sym->name));
+  }
+
+  fputc('\n', f);
+  fputs("#include \"framework/api.h\"\n", f);
+  fclose(f);
+
+  idset_free(&selected);
+  idset_free(&used);
+  return true;
+}
+
+/* =======================
+   Preprocess helper
+   ======================= */
+
+// Preprocessor commands run without a shell: the command line is split into
+// argv here, honouring '...' and "..." quoting and backslash escapes, and
+// every "{file}" is replaced by `file`. A command without "{file}" gets the
+// file appended as its last argument (unless `file` is NULL).
+static char **split_command(const char *cmd, const char *file) {
+  size_t cap = 8, argc = 0;
+  char **argv = (char **)xmalloc(cap * sizeof(char *));
+  bool used_file = false;
+  const char *p = cmd;
+  for (;;) {
+    while (*p == ' ' || *p == '\t' || *p == '\n')
+      p++;
+    if (!*p)
+      break;
+    size_t wcap = 64, wlen = 0;
+    char *w = (char *)xmalloc(wcap);
+    char quote = 0;
+    for (; *p && (quote || (*p != ' ' && *p != '\t' && *p != '\n')); p++) {
+      const char *piece = p;
+      size_t n = 1;
+      if (quote && *p == quote) {
+        quote = 0;
+        continue;
+      } else if (!quote && (*p == '\'' || *p == '"')) {
+        quote = *p;
+        continue;
+      } else if (*p == '\\' && quote != '\'' && p[1]) {
+        piece = ++p;
+      } else if (file && strncmp(p, "{file}", 6) == 0) {
+        piece = file;
+        n = strlen(file);
+        p += 5;
+        used_file = true;
+      }
+      if (wlen + n + 1 > wcap) {
+        wcap = (wlen + n + 1) * 2;
+        w = (char *)xrealloc(w, wcap);
+      }
+      memcpy(w + wlen, piece, n);
+      wlen += n;
+    }
+    w[wlen] = 0;
+    if (argc + 2 >= cap) {
+      cap *= 2;
+      argv = (char **)xrealloc(argv, cap * sizeof(char *));
+    }
+    argv[argc++] = w;
+  }
+  if (file && !used_file)
+    argv[argc++] = xstrdup(file);
+  argv[argc] = NULL;
+  if (argc == 0)
+    die("--preprocess: empty command");
+  return argv;
+}
+
+static void free_argv(char **argv) {
+  for (char **a = argv; *a; a++)
+    free(*a);
+  free(argv);
+}
+
+extern char **environ;
+
+// Spawns from several threads must not leak one child's pipe into another
+// (the reader would then wait for the wrong child to exit), so creating the
+// pipe, marking it close-on-exec and spawning happen under one lock.
+static pthread_mutex_t g_spawn_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Run argv[0] (searched in PATH) and return its stdout, drained with large
+// read()s. NULL, after a message on stderr, if it cannot start or fails.
+static char *run_preprocessor(char *const argv[], size_t *out_len) {
+  int fds[2];
+  pid_t pid;
+  posix_spawn_file_actions_t fa;
+  posix_spawn_file_actions_init(&fa);
+
+  pthread_mutex_lock(&g_spawn_lock);
+  if (pipe(fds) != 0) {
+    pthread_mutex_unlock(&g_spawn_lock);
+    posix_spawn_file_actions_destroy(&fa);
+    fprintf(stderr, "error: pipe: %s\n", strerror(errno));
+    return NULL;
+  }
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+  posix_spawn_file_actions_adddup2(&fa, fds[1], STDOUT_FILENO);
+  int rc = posix_spawnp(&pid, argv[0], &fa, NULL, argv, environ);
+  pthread_mutex_unlock(&g_spawn_lock);
+  posix_spawn_file_actions_destroy(&fa);
+  close(fds[1]);
+  if (rc != 0) {
+    close(fds[0]);
+    fprintf(stderr, "error: failed to run %s: %s\n", argv[0], strerror(rc));
+    return NULL;
+  }
+
+  char *text = read_fd(fds[0], 0, out_len);
+  close(fds[0]);
+  int status;
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+    ;
+  if (!text || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "error: %s failed\n", argv[0]);
+    free(text);
+    return NULL;
+  }
+  return text;
+}
+
+/* =======================
+   NEEDS batch (--entries / --compile-commands)
+   ======================= */
+
+typedef struct {
+  char *path; // entry source file
+  char *out;  // expanded output path
+  bool ok;
+} NeedsEntry;
+
+typedef struct {
+  NeedsEntry *data;
+  size_t len, cap;
+  StrSet seen; // paths already listed
+} EntryList;
+
+static void entries_add(EntryList *el, char *path) {
+  if (!el->seen.keys)
+    set_init(&el->seen, 256);
+  if (set_has(&el->seen, path)) { // listed twice: keep one
+    free(path);
+    return;
+  }
+  set_add(&el->seen, path);
+  if (el->len == el->cap) {
+    el->cap = el->cap ? el->cap * 2 : 64;
+    el->data = (NeedsEntry *)xrealloc(el->data, el->cap * sizeof(NeedsEntry));
+  }
+  NeedsEntry e = {path, NULL, false};
+  el->data[el->len++] = e;
+}
+
+// One path per line; blank lines and lines starting with '#' are skipped.
+static void entries_from_list(EntryList *el, const char *list_path) {
+  size_t n = 0;
+  char *text = read_entire_file(list_path, &n);
+  if (!text)
+    die("failed to read --entries list");
+  for (char *line = text; line < text + n;) {
+    char *eol = memchr(line, '\n', (size_t)(text + n - line));
+    if (!eol)
+      eol = text + n;
+    char *b = line, *e = eol;
+    while (b < e && isspace((unsigned char)*b))
+      b++;
+    while (e > b && isspace((unsigned char)e[-1]))
+      e--;
+    if (e > b && *b != '#')
+      entries_add(el, xstrndup(b, (size_t)(e - b)));
+    line = eol + 1;
+  }
+  free(text);
+}
+
+// Minimal JSON reading for compile_commands.json: strings are decoded (\u
+// escapes outside ASCII become '?'), every other value is skipped.
+static const char *json_ws(const char *p) {
+  while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+    p++;
+  return p;
+}
+
+static const char *json_string(const char *p, char **out) {
+  if (*p != '"')
+    return NULL;
+  p++;
+  size_t cap = 64, len = 0;
+  char *buf = (char *)xmalloc(cap);
+  while (*p && *p != '"') {
+    char c = *p++;
+    if (c == '\\') {
+      char e = *p++;
+      switch (e) {
+      case 'n':
+        c = '\n';
+        break;
+      case 't':
+        c = '\t';
+        break;
+      case 'r':
+        c = '\r';
+        break;
+      case 'b':
+        c = '\b';
+        break;
+      case 'f':
+        c = '\f';
+        break;
+      case 'u': {
+        unsigned v = 0;
+        for (int k = 0; k < 4 && isxdigit((unsigned char)*p); k++, p++)
+          v = v * 16 + (unsigned)(isdigit((unsigned char)*p)
+                                      ? *p - '0'
+                                      : tolower((unsigned char)*p) - 'a' + 10);
+        c = v < 0x80 ? (char)v : '?';
+        break;
+      }
+      case 0:
+        free(buf);
+        return NULL;
+      default: // \" \\ \/
+        c = e;
+        break;
+      }
+    }
+    if (len + 1 >= cap) {
+      cap *= 2;
+      buf = (char *)xrealloc(buf, cap);
+    }
+    buf[len++] = c;
+  }
+  if (*p != '"') {
+    free(buf);
+    return NULL;
+  }
+  buf[len] = 0;
+  *out = buf;
+  return p + 1;
+}
+
+static const char *json_skip(const char *p) {
+  p = json_ws(p);
+  if (*p == '"') {
+    char *tmp;
+    p = json_string(p, &tmp);
+    if (p)
+      free(tmp);
+    return p;
+  }
+  if (*p == '[' || *p == '{') {
+    char close = *p == '[' ? ']' : '}';
+    p = json_ws(p + 1);
+    while (p && *p != close) {
+      p = json_skip(p);
+      if (!p)
+        return NULL;
+      p = json_ws(p);
+      if (*p == ':' || *p == ',')
+        p = json_ws(p + 1);
+      else if (*p != close)
+        return NULL;
+    }
+    return p ? p + 1 : NULL;
+  }
+  while (*p && !strchr(",]} \t\r\n", *p)) // numbers, true, false, null
+    p++;
+  return p;
+}
+
+// Each compile_commands.json entry contributes its "file", resolved against
+// its "directory" when relative.
+static void entries_from_compile_commands(EntryList *el, const char *path) {
+  size_t n = 0;
+  char *text = read_entire_file(path, &n);
+  if (!text)
+    die("failed to read --compile-commands file");
+  const char *p = json_ws(text);
+  if (*p != '[')
+    die("compile commands: expected a JSON array");
+  p = json_ws(p + 1);
+  while (p && *p == '{') {
+    char *dir = NULL, *file = NULL;
+    p = json_ws(p + 1);
+    while (p && *p == '"') {
+      char *key;
+      p = json_string(p, &key);
+      if (!p)
+        break;
+      p = json_ws(p);
+      if (*p != ':') {
+        free(key);
+        p = NULL;
+        break;
+      }
+      p = json_ws(p + 1);
+      char **slot = strcmp(key, "directory") == 0 ? &dir
+                    : strcmp(key, "file") == 0    ? &file
+                                                  : NULL;
+      free(key);
+      if (slot && *p == '"') {
+        free(*slot);
+        p = json_string(p, slot);
+      } else {
+        p = json_skip(p);
+      }
+      if (p) {
+        p = json_ws(p);
+        if (*p == ',')
+          p = json_ws(p + 1);
+      }
+    }
+    if (!p || *p != '}')
+      die("compile commands: malformed entry");
+    if (file)
+      entries_add(el, file[0] == '/' || !dir ? xstrdup(file)
+                                             : path_join(dir, file));
+    free(dir);
+    free(file);
+    p = json_ws(p + 1);
+    if (*p == ',')
+      p = json_ws(p + 1);
+  }
+  if (!p || *p != ']')
+    die("compile commands: malformed array");
+  free(text);
+}
+
+// Expand {dir}, {name} and {stem} in an output template for one entry:
+// "src/ui/menu.c" gives dir "src/ui", name "menu.c", stem "menu".
+static char *expand_out_template(const char *tmpl, const char *entry) {
+  const char *slash = strrchr(entry, '/');
+  const char *name = slash ? slash + 1 : entry;
+  const char *dot = strrchr(name, '.');
+  size_t dir_len = slash ? (size_t)(slash - entry) : 1;
+  const char *dir = slash ? entry : ".";
+  if (slash && dir_len == 0) // "/x.c"
+    dir_len = 1;
+  size_t name_len = strlen(name);
+  size_t stem_len = dot && dot != name ? (size_t)(dot - name) : name_len;
+
+  size_t cap = strlen(tmpl) + 1, len = 0;
+  char *out = (char *)xmalloc(cap);
+  for (const char *t = tmpl; *t;) {
+    const char *piece = t;
+    size_t n = 1;
+    if (strncmp(t, "{dir}", 5) == 0) {
+      piece = dir, n = dir_len, t += 5;
+    } else if (strncmp(t, "{name}", 6) == 0) {
+      piece = name, n = name_len, t += 6;
+    } else if (strncmp(t, "{stem}", 6) == 0) {
+      piece = name, n = stem_len, t += 6;
+    } else {
+      t++;
+    }
+    if (len + n + 1 > cap) {
+      cap = (len + n + 1) * 2;
+      out = (char *)xrealloc(out, cap);
+    }
+    memcpy(out + len, piece, n);
+    len += n;
+  }
+  out[len] = 0;
+  return out;
+}
 
-    fprintf(f, "#define IMPORT_%s 1\n", sym->name);
+typedef struct {
+  const NeedsIndex *nx;
+  NeedsEntry *entries;
+  const char *pre_cmd; // preprocess command template, or NULL
+} NeedsBatch;
+
+static void needs_task(void *arg, size_t task, int worker) {
+  (void)worker;
+  NeedsBatch *nb = (NeedsBatch *)arg;
+  NeedsEntry *e = &nb->entries[task];
+  size_t n = 0;
+  char *text;
+  if (nb->pre_cmd) {
+    // the worker waits on its child, so `jobs` bounds the children
+    char **argv = split_command(nb->pre_cmd, e->path);
+    text = run_preprocessor(argv, &n);
+    free_argv(argv);
+    if (!text) {
+      fprintf(stderr, "error: preprocessing %s failed\n", e->path);
+      return;
+    }
+  } else {
+    text = read_entire_file(e->path, &n);
+    if (!text) {
+      fprintf(stderr, "error: failed to read entry %s: %s\n", e->path,
+              strerror(errno));
+      return;
+    }
   }
+  e->ok = emit_auto_import(nb->nx, e->out, text);
+  free(text);
+}
 
-  fputc('\n', f);
-  fputs("#include \"framework/api.h\"\n", f);
-  fclose(f);
+// Generate one auto_import header per entry from a single scan of the tree.
+// With `pre_cmd`, each entry is read through its own preprocessor child
+// (see split_command for the {file} substitution). Returns the number of
+// entries that failed.
+static size_t needs_batch(const NeedsIndex *nx, EntryList *el,
+                          const char *out_tmpl, const char *pre_cmd,
+                          int jobs) {
+  if (el->len > 1 && !strstr(out_tmpl, "{stem}") &&
+      !strstr(out_tmpl, "{name}"))
+    die("needs: with several entries --auto_out must use {stem} or {name}");
+  StrSet outs;
+  set_init(&outs, 256);
+  for (size_t i = 0; i < el->len; i++) {
+    NeedsEntry *e = &el->data[i];
+    e->out = expand_out_template(out_tmpl, e->path);
+    if (set_has(&outs, e->out)) {
+      fprintf(stderr, "error: %s maps to %s, which another entry uses\n",
+              e->path, e->out);
+      die("needs: output template is not unique for these entries");
+    }
+    set_add(&outs, e->out);
+  }
+  set_free(&outs);
+
+  NeedsBatch nb = {nx, el->data, pre_cmd};
+  if ((size_t)jobs > el->len)
+    jobs = el->len ? (int)el->len : 1;
+  Pool pool;
+  pool_init(&pool, jobs, el->len ? el->len : 1, needs_task, &nb);
+  for (size_t i = 0; i < el->len; i++)
+    pool_inject(&pool, i);
+  pool_run(&pool);
+  pool_destroy(&pool);
+
+  size_t failed = 0;
+  for (size_t i = 0; i < el->len; i++) {
+    if (el->data[i].ok)
+      printf("Wrote %s\n", el->data[i].out);
+    else
+      failed++;
+  }
+  return failed;
+}
 
-  set_free(&selected);
-  set_free(&used);
-  set_free(&all_names);
-  set_free(&type_names);
-  set_free(&fn_names);
+static void entries_free(EntryList *el) {
+  for (size_t i = 0; i < el->len; i++) {
+    free(el->data[i].path);
+    free(el->data[i].out);
+  }
+  free(el->data);
+  set_free(&el->seen);
 }
 
 /* =======================
-   Preprocess helper
+   Commands
    ======================= */
 
-static char *read_cmd_output(const char *cmd) {
-  FILE *p = popen(cmd, "r");
-  if (!p)
-    return NULL;
-
-  size_t cap = 1 << 20; // 1MB start
-  size_t len = 0;
-  char *buf = (char *)xmalloc(cap);
+typedef struct {
+  const char *cmd;
+  const char *root;
+  bool root_given;
+  const char *out_def;
+  const char *out_index;
+  const char *fn_prefix;
+
+  const char *s_kind;
+  const char *s_name;
+  const char *s_pattern;
+
+  const char *entry_path;
+  const char *entries_arg;
+  const char *compile_commands;
+  const char *auto_out;
+  const char *vis_mode;
+  const char *pre_cmd;
+
+  const char *allow_backend;   // e.g. "sdl"
+  const char *exclude_backend; // e.g. "raylib"
+  const char *exclude_path;    // e.g. "Raylib"
+  bool show_stats;
+  int jobs;
+  const char *cache_arg;
+  bool use_cache;
+  const char *socket_path;
+} Options;
+
+// argv[1] is the command; unknown options are ignored.
+static void parse_options(Options *o, int argc, char **argv) {
+  memset(o, 0, sizeof(*o));
+  o->cmd = argv[1];
+  o->root = ".";
+  o->out_def = "generated/api.def";
+  o->out_index = "generated/api_index.json";
+  o->auto_out = "generated/auto_import.h";
+  o->vis_mode = "public";
+  o->jobs = online_cpus();
+  o->use_cache = true;
 
-  int c;
-  while ((c = fgetc(p)) != EOF) {
-    if (len + 1 >= cap) {
-      cap *= 2;
-      buf = (char *)realloc(buf, cap);
-      if (!buf)
-        die("out of memory");
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "--root") == 0 && i + 1 < argc) {
+      o->root = argv[++i];
+      o->root_given = true;
+    } else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc)
+      o->out_def = argv[++i];
+    else if (strcmp(argv[i], "--index") == 0 && i + 1 < argc)
+      o->out_index = argv[++i];
+    else if (strcmp(argv[i], "--fn_prefix") == 0 && i + 1 < argc)
+      o->fn_prefix = argv[++i];
+    else if (strcmp(argv[i], "--kind") == 0 && i + 1 < argc)
+      o->s_kind = argv[++i];
+    else if (strcmp(argv[i], "--name") == 0 && i + 1 < argc)
+      o->s_name = argv[++i];
+    else if (strcmp(argv[i], "--pattern") == 0 && i + 1 < argc)
+      o->s_pattern = argv[++i];
+    else if (strcmp(argv[i], "--entry") == 0 && i + 1 < argc)
+      o->entry_path = argv[++i];
+    else if (strcmp(argv[i], "--entries") == 0 && i + 1 < argc)
+      o->entries_arg = argv[++i];
+    else if (strcmp(argv[i], "--compile-commands") == 0 && i + 1 < argc)
+      o->compile_commands = argv[++i];
+    else if (strcmp(argv[i], "--auto_out") == 0 && i + 1 < argc)
+      o->auto_out = argv[++i];
+    else if (strcmp(argv[i], "--vis") == 0 && i + 1 < argc)
+      o->vis_mode = argv[++i];
+    else if (strcmp(argv[i], "--preprocess") == 0 && i + 1 < argc)
+      o->pre_cmd = argv[++i];
+    else if (strcmp(argv[i], "--backend") == 0 && i + 1 < argc)
+      o->allow_backend = argv[++i];
+    else if (strcmp(argv[i], "--exclude_backend") == 0 && i + 1 < argc)
+      o->exclude_backend = argv[++i];
+    else if (strcmp(argv[i], "--exclude_path") == 0 && i + 1 < argc)
+      o->exclude_path = argv[++i];
+    else if (strcmp(argv[i], "--stats") == 0)
+      o->show_stats = true;
+    else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc)
+      o->cache_arg = argv[++i];
+    else if (strcmp(argv[i], "--no-cache") == 0)
+      o->use_cache = false;
+    else if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc)
+      o->socket_path = argv[++i];
+    else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+      o->jobs = atoi(argv[++i]);
+      if (o->jobs < 1)
+        die("--jobs needs a positive thread count");
     }
-    buf[len++] = (char)c;
   }
-  buf[len] = 0;
-  pclose(p);
-  return buf;
 }
 
-
-
-/* =======================
-   Main
-   ======================= */
+// The scan cache to use, or NULL with --no-cache.
+static char *cache_path_of(const Options *o) {
+  if (!o->use_cache)
+    return NULL;
+  return o->cache_arg ? xstrdup(o->cache_arg)
+                      : path_join(o->root, ".api_tool_cache");
+}
 
 static void usage(void) {
   puts("  gen    --root <dir> --out generated/api.def --index generated/api_index.json "
@@ -1289,134 +4522,970 @@ static void usage(void) {
        "[--exclude_path <substr>]\n"
        "  needs  --root <dir> --entry <file.c> --out generated/auto_import.h --vis "
        "public|private [--preprocess <cmd>] [--backend <sdl|raylib|core>] "
-       "[--exclude_backend <name>] [--exclude_path <substr>]\n");
+       "[--exclude_backend <name>] [--exclude_path <substr>]\n"
+       "  needs  --root <dir> (--entries @list.txt | --compile-commands "
+       "compile_commands.json) --auto_out 'gen/{dir}/{stem}_import.h' "
+       "[--vis ...] [--preprocess <cmd>]\n"
+       "  serve  --root <dir> [--socket <path>] (default: "
+       "<root>/.api_tool.sock): keep the index in memory and answer the "
+       "commands above when they are given --socket <path>\n"
+       "  any command also takes --jobs <n> (scan threads, default: online "
+       "CPUs), --stats (scan and allocation counts on stderr), --cache <file> "
+       "(default: <root>/.api_tool_cache) and --no-cache\n");
 }
 
-int main(int argc, char **argv) {
-  if (argc < 2) {
-    usage();
+static void print_stats(void) {
+  stats_flush();
+  const Stats *st = &g_stats_total;
+  size_t nfiles = st->files + st->files_cached;
+  fprintf(stderr,
+          "stats: %zu files (%zu mapped), %zu lines, %zu bytes scanned\n"
+          "stats: %zu files from the scan cache (%zu by content hash)\n"
+          "stats: %zu allocs, %zu reallocs, %zu bytes requested\n"
+          "stats: %zu symbols, %zu allocs while scanning (%.2f per file, "
+          "%.2f per symbol)\n",
+          st->files, st->files_mapped, st->lines, st->bytes, st->files_cached,
+          st->files_rehashed, st->allocs, st->reallocs, st->alloc_bytes,
+          st->symbols, st->scan_allocs,
+          nfiles ? (double)st->scan_allocs / (double)nfiles : 0.0,
+          st->symbols ? (double)st->scan_allocs / (double)st->symbols : 0.0);
+}
+
+// gen over `syms`, or, when it is NULL, streamed from a scan of the tree.
+static int cmd_gen(const Options *o, const SymVec *syms) {
+  ensure_parent_dir(o->out_index);
+  ensure_parent_dir(o->out_def);
+  GenWriter gw;
+  gen_open(&gw, o->out_index, o->out_def, o->fn_prefix,
+           o->allow_backend && *o->allow_backend ? intern_str(o->allow_backend)
+                                                 : STR_NONE,
+           o->exclude_backend ? intern_str(o->exclude_backend) : STR_NONE);
+  if (syms) {
+    gen_syms(&gw, syms);
+  } else {
+    char *cache_path = cache_path_of(o);
+    scan_tree_each(o->root, o->jobs, cache_path, gen_render, gen_file, &gw);
+    free(cache_path);
+  }
+  gen_close(&gw);
+  printf("%s %s\n%s %s\n", gw.def_changed ? "Wrote" : "Unchanged",
+         o->out_def, gw.index_changed ? "Wrote" : "Unchanged", o->out_index);
+  return 0;
+}
+
+static int cmd_search(const Options *o, const SymVec *syms) {
+  do_search(syms, o->s_kind, o->s_name, o->s_pattern);
+  return 0;
+}
+
+static int cmd_needs(const Options *o, const SymVec *syms) {
+  if (o->entries_arg || o->compile_commands) {
+    EntryList el = {0};
+    if (o->entries_arg && o->entries_arg[0] == '@')
+      entries_from_list(&el, o->entries_arg + 1);
+    else if (o->entries_arg)
+      entries_add(&el, xstrdup(o->entries_arg));
+    if (o->compile_commands)
+      entries_from_compile_commands(&el, o->compile_commands);
+
+    NeedsIndex nx;
+    needs_index_build(&nx, syms, o->vis_mode, o->jobs);
+    size_t failed = needs_batch(&nx, &el, o->auto_out, o->pre_cmd, o->jobs);
+    needs_index_free(&nx);
+    entries_free(&el);
+    return failed ? 1 : 0;
+  }
+
+  if (!o->entry_path && !o->pre_cmd)
+    die("needs: provide --entry <file> and/or --preprocess <cmd>");
+  char *entry_text = NULL;
+
+  if (o->pre_cmd && *o->pre_cmd) {
+    bool has_file = strstr(o->pre_cmd, "{file}") != NULL;
+    if (has_file && !o->entry_path)
+      die("needs: --preprocess uses {file} but no --entry was given");
+    char **pre_argv =
+        split_command(o->pre_cmd, has_file ? o->entry_path : NULL);
+    size_t n = 0;
+    entry_text = run_preprocessor(pre_argv, &n);
+    free_argv(pre_argv);
+    if (!entry_text)
+      die("failed to run preprocess command");
+  } else {
+    size_t n = 0;
+    entry_text = read_entire_file(o->entry_path, &n);
+    if (!entry_text)
+      die("failed to read entry file");
+  }
+
+  NeedsIndex nx;
+  needs_index_build(&nx, syms, o->vis_mode, o->jobs);
+  if (!emit_auto_import(&nx, o->auto_out, entry_text))
+    die("failed to open auto_import output");
+  printf("Wrote %s\n", o->auto_out);
+  needs_index_free(&nx);
+  free(entry_text);
+  return 0;
+}
+
+// The commands that read the symbol set.
+static bool is_query(const char *cmd) {
+  return strcmp(cmd, "gen") == 0 || strcmp(cmd, "search") == 0 ||
+         strcmp(cmd, "needs") == 0;
+}
+
+// Run query command o->cmd over `syms`; returns the exit status.
+static int run_command(const Options *o, const SymVec *syms) {
+  if (strcmp(o->cmd, "gen") == 0)
+    return cmd_gen(o, syms);
+  if (strcmp(o->cmd, "search") == 0)
+    return cmd_search(o, syms);
+  return cmd_needs(o, syms);
+}
+
+/* =======================
+   Server (serve, --socket)
+   ======================= */
+
+// `serve` keeps the symbols of a tree in memory and answers gen, search and
+// needs over a Unix domain socket; given `--socket <path>`, those commands
+// are sent there instead of scanning the tree. The server watches the tree
+// with inotify (Linux only) and rescans files as they change.
+//
+// Changes are merged by an updater thread, which publishes each new state
+// of the symbol set as an immutable, reference-counted snapshot, swapped in
+// with one atomic exchange (read-copy-update). Queries never wait for it:
+// one arriving mid-merge pins the last published snapshot, and snapshots
+// share the symbols of files that did not change.
+//
+// Every query runs in a child forked from the server, so it sees the
+// snapshot that was current when it arrived, and behaves exactly like the
+// command run locally: the client passes its working directory, stdout and
+// stderr over the socket (SCM_RIGHTS), the child works in that directory
+// and writes to those, and the child's exit status goes back to the client
+// as one byte. A request is a u32 length, sent with the three descriptors,
+// then that many bytes of arguments (argv[1..]), each NUL-terminated.
+
+#define SERVE_MAX_REQUEST (1024 * 1024)
+
+static void socket_addr(struct sockaddr_un *addr, const char *path) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path))
+    die("socket path too long");
+  memcpy(addr->sun_path, path, strlen(path) + 1);
+}
+
+static int connect_server(const char *path) {
+  struct sockaddr_un addr;
+  socket_addr(&addr, path);
+  int s = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (s < 0)
+    return -1;
+  if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    int err = errno;
+    close(s);
+    errno = err;
+    return -1;
+  }
+  return s;
+}
+
+// Run argv[1..] on the server at o->socket_path; returns its exit status.
+static int client_main(const Options *o, int argc, char **argv) {
+  int s = connect_server(o->socket_path);
+  if (s < 0) {
+    fprintf(stderr, "error: no server at %s: %s\n", o->socket_path,
+            strerror(errno));
     return 1;
   }
-  const char *cmd = argv[1];
+  signal(SIGPIPE, SIG_IGN); // a refused request fails the send instead
+  Buf req = {0};
+  for (int i = 1; i < argc; i++)
+    buf_put(&req, argv[i], strlen(argv[i]) + 1);
+  if (req.len > SERVE_MAX_REQUEST)
+    die("request too long");
+
+  int fds[3] = {open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC), STDOUT_FILENO,
+                STDERR_FILENO};
+  if (fds[0] < 0)
+    die("cannot open the working directory");
+  uint32_t len = (uint32_t)req.len;
+  struct iovec iov = {&len, sizeof(len)};
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(fds))];
+  } ctl;
+  memset(&ctl, 0, sizeof(ctl));
+  struct msghdr m;
+  memset(&m, 0, sizeof(m));
+  m.msg_iov = &iov;
+  m.msg_iovlen = 1;
+  m.msg_control = ctl.buf;
+  m.msg_controllen = sizeof(ctl.buf);
+  struct cmsghdr *c = CMSG_FIRSTHDR(&m);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(c), fds, sizeof(fds));
+  ssize_t w;
+  while ((w = sendmsg(s, &m, 0)) < 0 && errno == EINTR)
+    ;
+  if (w != (ssize_t)sizeof(len) || !write_full(s, req.data, req.len))
+    die("failed to send the request");
+  free(req.data);
+  close(fds[0]);
+
+  unsigned char status;
+  ssize_t r;
+  while ((r = read(s, &status, 1)) < 0 && errno == EINTR)
+    ;
+  close(s);
+  if (r != 1)
+    die("the server dropped the request");
+  return status;
+}
+
+#if defined(__linux__)
+
+// Files are rescanned once their writer closes them (or they are renamed
+// into place), not on every write.
+#define SERVE_WATCH_MASK                                                       \
+  (IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO |     \
+   IN_ONLYDIR)
+
+// A file of the served tree; only files with symbols are kept. Never
+// changed once scanned: a rescan makes a new one. The updater's table holds
+// one reference and every snapshot listing the file another.
+typedef struct {
+  atomic_int refs;
+  StrId path;
+  SymVec syms;
+} ServeFile;
+
+static void serve_file_put(ServeFile *f) {
+  if (atomic_fetch_sub(&f->refs, 1) == 1) {
+    free_syms(&f->syms);
+    free(f);
+  }
+}
 
-  const char *root = ".";
-  const char *out_def = "generated/api.def";
-  const char *out_index = "generated/api_index.json";
-  const char *fn_prefix = NULL;
+// What queries read. The server's `current` pointer holds one reference,
+// and a reader pins another while it uses the snapshot.
+typedef struct {
+  atomic_int refs;
+  ServeFile **files; // in path order
+  size_t nfiles;
+  SymVec view; // every symbol, in path order; shares the files' data
+} Snapshot;
+
+static void snapshot_put(Snapshot *sn) {
+  if (atomic_fetch_sub(&sn->refs, 1) != 1)
+    return;
+  for (size_t i = 0; i < sn->nfiles; i++)
+    serve_file_put(sn->files[i]);
+  free(sn->files);
+  free(sn->view.data);
+  free(sn);
+}
 
-  const char *s_kind = NULL;
-  const char *s_name = NULL;
-  const char *s_pattern = NULL;
+typedef struct {
+  pid_t pid;
+  int conn; // gets the exit status
+} ServeQuery;
 
-  const char *entry_path = NULL;
-  const char *auto_out = "generated/auto_import.h";
-  const char *vis_mode = "public";
-  const char *pre_cmd = NULL;
+typedef struct {
+  const Options *o;
+  char *root; // absolute
+  int root_fd;
+
+  // Updater thread only.
+  ServeFile **files; // in path order
+  size_t nfiles, files_cap;
+  bool changed; // files changed since the last snapshot
+  int ino;
+  char **watch_dir; // by watch descriptor: the directory, relative to root
+  size_t watch_cap;
+  char **dirty; // files to rescan (relative to root)
+  size_t ndirty, dirty_cap;
+  bool rescan_all;   // events were lost
+  bool watch_failed; // a directory that is scanned could not be watched
+  int stop_pipe[2];
+
+  // Shared.
+  _Atomic(Snapshot *) current;
+  atomic_int pinning; // readers between loading `current` and pinning it
+
+  // Main thread only.
+  int listen_fd, sig_fd;
+  ServeQuery *queries; // children still running
+  size_t nqueries, queries_cap;
+} Server;
+
+// Make the files table the current snapshot. The old one is released once
+// no reader can still be about to pin it (its grace period): a reader that
+// loaded it has raised `pinning` first, and one that raises `pinning` after
+// we see it at zero loads the new pointer.
+static void serve_publish(Server *sv) {
+  Snapshot *sn = (Snapshot *)xcalloc(1, sizeof(Snapshot));
+  atomic_init(&sn->refs, 1);
+  sn->nfiles = sv->nfiles;
+  sn->files = (ServeFile **)xmalloc((sv->nfiles + 1) * sizeof(ServeFile *));
+  size_t total = 0;
+  for (size_t i = 0; i < sv->nfiles; i++) {
+    sn->files[i] = sv->files[i];
+    atomic_fetch_add(&sv->files[i]->refs, 1);
+    total += sv->files[i]->syms.len;
+  }
+  sn->view.data = (Symbol *)xmalloc((total + 1) * sizeof(Symbol));
+  sn->view.cap = total;
+  for (size_t i = 0; i < sv->nfiles; i++) {
+    const SymVec *fs = &sv->files[i]->syms;
+    memcpy(sn->view.data + sn->view.len, fs->data, fs->len * sizeof(Symbol));
+    sn->view.len += fs->len;
+  }
 
-  const char *allow_backend = NULL;      // e.g. "sdl"
-  const char *exclude_backend = NULL;    // e.g. "raylib"
-  const char *exclude_path = NULL;       // e.g. "Raylib"
+  Snapshot *old = atomic_exchange(&sv->current, sn);
+  while (atomic_load(&sv->pinning) != 0)
+    sched_yield();
+  if (old)
+    snapshot_put(old);
+}
 
-  for (int i = 2; i < argc; i++) {
-    if (strcmp(argv[i], "--root") == 0 && i + 1 < argc)
-      root = argv[++i];
-    else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc)
-      out_def = argv[++i];
-    else if (strcmp(argv[i], "--index") == 0 && i + 1 < argc)
-      out_index = argv[++i];
-    else if (strcmp(argv[i], "--fn_prefix") == 0 && i + 1 < argc)
-      fn_prefix = argv[++i];
-    else if (strcmp(argv[i], "--kind") == 0 && i + 1 < argc)
-      s_kind = argv[++i];
-    else if (strcmp(argv[i], "--name") == 0 && i + 1 < argc)
-      s_name = argv[++i];
-    else if (strcmp(argv[i], "--pattern") == 0 && i + 1 < argc)
-      s_pattern = argv[++i];
-    else if (strcmp(argv[i], "--entry") == 0 && i + 1 < argc)
-      entry_path = argv[++i];
-    else if (strcmp(argv[i], "--auto_out") == 0 && i + 1 < argc)
-      auto_out = argv[++i];
-    else if (strcmp(argv[i], "--vis") == 0 && i + 1 < argc)
-      vis_mode = argv[++i];
-    else if (strcmp(argv[i], "--preprocess") == 0 && i + 1 < argc)
-      pre_cmd = argv[++i];
-    else if (strcmp(argv[i], "--backend") == 0 && i + 1 < argc)
-      allow_backend = argv[++i];
-    else if (strcmp(argv[i], "--exclude_backend") == 0 && i + 1 < argc)
-      exclude_backend = argv[++i];
-    else if (strcmp(argv[i], "--exclude_path") == 0 && i + 1 < argc)
-      exclude_path = argv[++i];
+// Take a reference to the current snapshot. Never waits for the updater.
+static Snapshot *serve_pin(Server *sv) {
+  atomic_fetch_add(&sv->pinning, 1);
+  Snapshot *sn = atomic_load(&sv->current);
+  atomic_fetch_add(&sn->refs, 1);
+  atomic_fetch_sub(&sv->pinning, 1);
+  return sn;
+}
+
+static void serve_mark(Server *sv, char *rel) {
+  if (sv->ndirty == sv->dirty_cap) {
+    sv->dirty_cap = sv->dirty_cap ? sv->dirty_cap * 2 : 64;
+    sv->dirty = (char **)xrealloc(sv->dirty, sv->dirty_cap * sizeof(char *));
+  }
+  sv->dirty[sv->ndirty++] = rel;
+}
+
+// Is `path` `dir` or inside it?
+static bool path_under(const char *path, const char *dir) {
+  size_t n = strlen(dir);
+  return strncmp(path, dir, n) == 0 && (path[n] == 0 || path[n] == '/');
+}
+
+// Watch directory `rel` ("" is the root) and every directory under it that
+// a scan would enter. With `mark`, the source files found are queued for
+// rescanning: they may have appeared before the watch did.
+static void serve_watch(Server *sv, const char *rel, bool mark) {
+  char *abs = path_join(sv->root, rel);
+  int wd = inotify_add_watch(sv->ino, abs, SERVE_WATCH_MASK);
+  free(abs);
+  if (wd < 0) {
+    // A directory already gone is handled by its parent's events, and one
+    // we may not read is not scanned either. Out of watches, every further
+    // directory fails the same way; the first warning says so.
+    int err = errno;
+    if (err != ENOENT && !(err == ENOSPC && sv->watch_failed))
+      fprintf(stderr, "warning: cannot watch %s: %s%s\n", *rel ? rel : ".",
+              strerror(err),
+              err == ENOSPC ? " (raise fs.inotify.max_user_watches)" : "");
+    if (err != ENOENT && err != EACCES)
+      sv->watch_failed = true;
+    return;
+  }
+  if ((size_t)wd >= sv->watch_cap) {
+    size_t cap = sv->watch_cap ? sv->watch_cap : 64;
+    while ((size_t)wd >= cap)
+      cap *= 2;
+    sv->watch_dir = (char **)xrealloc(sv->watch_dir, cap * sizeof(char *));
+    memset(sv->watch_dir + sv->watch_cap, 0,
+           (cap - sv->watch_cap) * sizeof(char *));
+    sv->watch_cap = cap;
+  }
+  if (sv->watch_dir[wd] && strcmp(sv->watch_dir[wd], rel) != 0)
+    return; // already watched under another name (a symlink)
+  free(sv->watch_dir[wd]);
+  sv->watch_dir[wd] = xstrdup(rel);
+
+  int fd = openat(sv->root_fd, *rel ? rel : ".",
+                  O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  DIR *d = fd >= 0 ? fdopendir(fd) : NULL;
+  if (!d) {
+    if (fd >= 0)
+      close(fd);
+    return;
+  }
+  struct dirent *ent;
+  while ((ent = readdir(d)) != NULL) {
+    const char *name = ent->d_name;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+        skip_dir_name(name))
+      continue;
+    unsigned char type = ent->d_type;
+    if (type == DT_UNKNOWN || type == DT_LNK) {
+      struct stat st;
+      if (fstatat(dirfd(d), name, &st, 0) != 0)
+        continue;
+      type = S_ISDIR(st.st_mode) ? DT_DIR
+             : S_ISREG(st.st_mode) ? DT_REG
+                                   : DT_UNKNOWN;
+    }
+    if (type == DT_DIR) {
+      char *child = path_join(rel, name);
+      serve_watch(sv, child, mark);
+      free(child);
+    } else if (mark && type == DT_REG && has_c_ext(name)) {
+      serve_mark(sv, path_join(rel, name));
+    }
   }
+  closedir(d);
+}
 
-  // Compile regexes
-  const char *FN_RE =
-      "^[[:space:]]*[A-Za-z_][A-Za-z0-9_[:space:]*]*[[:space:]]+"
-      "([A-Za-z_][A-Za-z0-9_]*)[[:space:]]*\\([^;{}]*\\)[[:space:]]*([;{])[[:"
-      "space:]]*$";
+// Index of `rel` in sv->files, or of where it would go.
+static size_t serve_find(const Server *sv, const char *rel, bool *found) {
+  size_t lo = 0, hi = sv->nfiles;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (strcmp(str_of(sv->files[mid]->path), rel) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  *found = lo < sv->nfiles && strcmp(str_of(sv->files[lo]->path), rel) == 0;
+  return lo;
+}
 
-  const char *TYPEDEF_STRUCT_RE =
-      "^[[:space:]]*typedef[[:space:]]+struct([[:space:]]+[A-Za-z_][A-Za-z0-9_]"
-      "*)?[[:space:]]*\\{";
+static void serve_drop(Server *sv, size_t i) {
+  serve_file_put(sv->files[i]);
+  memmove(sv->files + i, sv->files + i + 1,
+          (sv->nfiles - i - 1) * sizeof(ServeFile *));
+  sv->nfiles--;
+  sv->changed = true;
+}
 
-  const char *STRUCT_RE =
-      "^[[:space:]]*struct[[:space:]]+([A-Za-z_][A-Za-z0-9_]*)[[:space:]]*\\{";
+static ServeFile *serve_file_new(SymVec *syms) {
+  ServeFile *f = (ServeFile *)xmalloc(sizeof(ServeFile));
+  atomic_init(&f->refs, 1);
+  f->path = syms->data[0].file;
+  f->syms = *syms;
+  return f;
+}
 
-  regex_t re_fn, re_ts, re_s;
-  if (regcomp(&re_fn, FN_RE, REG_EXTENDED | REG_NEWLINE) != 0)
-    die("regcomp fn failed");
-  if (regcomp(&re_ts, TYPEDEF_STRUCT_RE, REG_EXTENDED | REG_NEWLINE) != 0)
-    die("regcomp typedef struct failed");
-  if (regcomp(&re_s, STRUCT_RE, REG_EXTENDED | REG_NEWLINE) != 0)
-    die("regcomp struct failed");
+// Replace the symbols of `rel` with `syms` (taken over; empty drops it).
+static void serve_put(Server *sv, const char *rel, SymVec *syms) {
+  bool found;
+  size_t i = serve_find(sv, rel, &found);
+  if (!syms->len) {
+    free_syms(syms);
+    if (found)
+      serve_drop(sv, i);
+    return;
+  }
+  if (found) {
+    serve_file_put(sv->files[i]);
+  } else {
+    if (sv->nfiles == sv->files_cap) {
+      sv->files_cap = sv->files_cap ? sv->files_cap * 2 : 256;
+      sv->files = (ServeFile **)xrealloc(sv->files,
+                                         sv->files_cap * sizeof(ServeFile *));
+    }
+    memmove(sv->files + i + 1, sv->files + i,
+            (sv->nfiles - i) * sizeof(ServeFile *));
+    sv->nfiles++;
+  }
+  sv->files[i] = serve_file_new(syms);
+  sv->changed = true;
+}
 
+static void serve_scan_file(Server *sv, const char *rel) {
   SymVec syms = {0};
-  walk_dir(root, root, &syms, &re_fn, &re_ts, &re_s);
-
-  regfree(&re_fn);
-  regfree(&re_ts);
-  regfree(&re_s);
-
-  if (strcmp(cmd, "gen") == 0) {
-    ensure_parent_dir(out_index);
-    ensure_parent_dir(out_def);
-    write_index_json(out_index, &syms);
-    emit_api_def(out_def, &syms, fn_prefix, allow_backend, exclude_backend);
-    printf("Wrote %s\nWrote %s\n", out_def, out_index);
-    free_syms(&syms);
-    return 0;
+  struct stat st;
+  if (fstatat(sv->root_fd, rel, &st, 0) == 0 && S_ISREG(st.st_mode)) {
+    SrcFile *src = src_load_at(sv->root_fd, rel);
+    if (src) {
+      FileScan *fs = file_scan_open(src, rel);
+      file_scan_range(fs, 0, fs->src->len, &syms);
+      file_scan_close(fs, &syms, 0);
+    }
   }
+  serve_put(sv, rel, &syms);
+}
 
-  if (strcmp(cmd, "search") == 0) {
-    do_search(&syms, s_kind, s_name, s_pattern);
-    free_syms(&syms);
-    return 0;
+// Forget directory `rel`, which was deleted or moved away.
+static void serve_forget_dir(Server *sv, const char *rel) {
+  for (size_t wd = 0; wd < sv->watch_cap; wd++) {
+    if (sv->watch_dir[wd] && path_under(sv->watch_dir[wd], rel)) {
+      inotify_rm_watch(sv->ino, (int)wd);
+      free(sv->watch_dir[wd]);
+      sv->watch_dir[wd] = NULL;
+    }
   }
+  for (size_t i = sv->nfiles; i-- > 0;)
+    if (path_under(str_of(sv->files[i]->path), rel))
+      serve_drop(sv, i);
+}
 
-  if (strcmp(cmd, "needs") == 0) {
-    if (!entry_path && !pre_cmd)
-      die("needs: provide --entry <file> and/or --preprocess <cmd>");
-    char *entry_text = NULL;
+// FileSink for a full scan.
+static void serve_collect(void *arg, SymVec *file_syms, Buf *parts,
+                          size_t nparts) {
+  (void)parts;
+  (void)nparts;
+  Server *sv = (Server *)arg;
+  if (!file_syms->len) {
+    free_syms(file_syms);
+    return;
+  }
+  if (sv->nfiles == sv->files_cap) {
+    sv->files_cap = sv->files_cap ? sv->files_cap * 2 : 256;
+    sv->files = (ServeFile **)xrealloc(sv->files,
+                                       sv->files_cap * sizeof(ServeFile *));
+  }
+  sv->files[sv->nfiles++] = serve_file_new(file_syms);
+}
 
-    if (pre_cmd && *pre_cmd) {
-      entry_text = read_cmd_output(pre_cmd);
-      if (!entry_text)
-        die("failed to run preprocess command");
-    } else {
-      size_t n = 0;
-      entry_text = read_entire_file(entry_path, &n);
-      if (!entry_text)
-        die("failed to read entry file");
+// Scan the whole tree into the files table. Readers keep using the last
+// snapshot meanwhile.
+static void serve_load(Server *sv) {
+  for (size_t i = 0; i < sv->nfiles; i++)
+    serve_file_put(sv->files[i]);
+  sv->nfiles = 0;
+  char *cache_path = cache_path_of(sv->o);
+  scan_tree_each(sv->root, sv->o->jobs, cache_path, NULL, serve_collect, sv);
+  free(cache_path);
+  sv->changed = true;
+}
+
+static void serve_event(Server *sv, const struct inotify_event *ev) {
+  if (ev->mask & IN_Q_OVERFLOW) {
+    sv->rescan_all = true;
+    return;
+  }
+  if (ev->wd < 0 || (size_t)ev->wd >= sv->watch_cap ||
+      !sv->watch_dir[ev->wd])
+    return;
+  if (ev->mask & IN_IGNORED) {
+    free(sv->watch_dir[ev->wd]);
+    sv->watch_dir[ev->wd] = NULL;
+    return;
+  }
+  if (!ev->len || skip_dir_name(ev->name))
+    return;
+  char *rel = path_join(sv->watch_dir[ev->wd], ev->name);
+  if (ev->mask & IN_ISDIR) {
+    if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+      serve_watch(sv, rel, true);
+    else if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+      serve_forget_dir(sv, rel);
+    free(rel);
+  } else if (has_c_ext(ev->name)) {
+    serve_mark(sv, rel);
+  } else {
+    free(rel);
+  }
+}
+
+static int cmp_str_ptr(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Take in every pending change: read the queued events, rescan the files
+// they name (each once) and publish the result.
+static void serve_sync(Server *sv) {
+  _Alignas(struct inotify_event) char buf[64 * 1024];
+  for (;;) {
+    ssize_t n = read(sv->ino, buf, sizeof(buf));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break; // EAGAIN: drained
+    for (char *p = buf; p < buf + n;) {
+      const struct inotify_event *ev = (const struct inotify_event *)p;
+      p += sizeof(*ev) + ev->len;
+      serve_event(sv, ev);
     }
+  }
+
+  if (sv->rescan_all) {
+    sv->rescan_all = false;
+    serve_watch(sv, "", false);
+    serve_load(sv);
+    for (size_t i = 0; i < sv->ndirty; i++)
+      free(sv->dirty[i]);
+    sv->ndirty = 0;
+  }
+  qsort(sv->dirty, sv->ndirty, sizeof(char *), cmp_str_ptr);
+  for (size_t i = 0; i < sv->ndirty; i++) {
+    if (i == 0 || strcmp(sv->dirty[i], sv->dirty[i - 1]) != 0)
+      serve_scan_file(sv, sv->dirty[i]);
+  }
+  for (size_t i = 0; i < sv->ndirty; i++)
+    free(sv->dirty[i]);
+  sv->ndirty = 0;
 
-    emit_auto_import(auto_out, &syms, entry_text, vis_mode);
-    printf("Wrote %s\n", auto_out);
+  if (sv->changed) {
+    sv->changed = false;
+    serve_publish(sv);
+  }
+}
 
-    free(entry_text);
-    free_syms(&syms);
-    return 0;
+// The updater thread: merges changes as inotify reports them, until a byte
+// arrives on stop_pipe.
+static void *serve_updater(void *arg) {
+  Server *sv = (Server *)arg;
+  struct pollfd pf[2] = {{sv->ino, POLLIN, 0}, {sv->stop_pipe[0], POLLIN, 0}};
+  for (;;) {
+    if (poll(pf, 2, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      die("poll failed");
+    }
+    if (pf[1].revents)
+      break;
+    if (pf[0].revents)
+      serve_sync(sv);
+  }
+  stats_flush();
+  return NULL;
+}
+
+// A query child must not inherit a lock the updater (or its scanners) held
+// at the fork, so fork() waits for them to be free. They are only held for
+// short, bounded steps.
+static void serve_fork_lock(void) {
+  for (unsigned i = 0; i < INTERN_SHARDS; i++)
+    pthread_mutex_lock(&g_intern[i].lock);
+  pthread_mutex_lock(&g_stats_lock);
+  pthread_mutex_lock(&g_jobserver.lock);
+}
+
+static void serve_fork_unlock(void) {
+  pthread_mutex_unlock(&g_jobserver.lock);
+  pthread_mutex_unlock(&g_stats_lock);
+  for (unsigned i = INTERN_SHARDS; i-- > 0;)
+    pthread_mutex_unlock(&g_intern[i].lock);
+}
+
+// Tokens held by the updater's scanners are theirs to return, not the
+// child's.
+static void serve_fork_child(void) {
+  g_jobserver.nheld = 0;
+  serve_fork_unlock();
+}
+
+// Read a request: the client's descriptors and its arguments.
+static bool serve_recv(int conn, int fds[3], char **args, uint32_t *len) {
+  struct iovec iov = {len, sizeof(*len)};
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(3 * sizeof(int))];
+  } ctl;
+  struct msghdr m;
+  memset(&m, 0, sizeof(m));
+  m.msg_iov = &iov;
+  m.msg_iovlen = 1;
+  m.msg_control = ctl.buf;
+  m.msg_controllen = sizeof(ctl.buf);
+  ssize_t r;
+  while ((r = recvmsg(conn, &m, MSG_WAITALL)) < 0 && errno == EINTR)
+    ;
+  struct cmsghdr *c = CMSG_FIRSTHDR(&m);
+  if (r != (ssize_t)sizeof(*len) || !c || c->cmsg_level != SOL_SOCKET ||
+      c->cmsg_type != SCM_RIGHTS || c->cmsg_len != CMSG_LEN(3 * sizeof(int)))
+    return false;
+  memcpy(fds, CMSG_DATA(c), 3 * sizeof(int));
+  if (*len > SERVE_MAX_REQUEST)
+    return false;
+  *args = (char *)xmalloc(*len + 1);
+  for (uint32_t got = 0; got < *len;) {
+    r = read(conn, *args + got, *len - got);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return false;
+    got += (uint32_t)r;
+  }
+  (*args)[*len] = 0;
+  return true;
+}
+
+// In the forked child: run one query over `sn` and exit with its status.
+static void serve_query(Server *sv, int conn, const Snapshot *sn) {
+  sigset_t none;
+  sigemptyset(&none);
+  sigprocmask(SIG_SETMASK, &none, NULL);
+  close(sv->listen_fd);
+  close(sv->sig_fd);
+  close(sv->ino);
+  close(sv->stop_pipe[0]);
+  close(sv->stop_pipe[1]);
+  for (size_t i = 0; i < sv->nqueries; i++)
+    close(sv->queries[i].conn);
+  memset(&g_stats_total, 0, sizeof(g_stats_total)); // --stats: this query
+  memset(&g_stats, 0, sizeof(g_stats));
+
+  int fds[3];
+  char *args;
+  uint32_t len;
+  if (!serve_recv(conn, fds, &args, &len))
+    _exit(1);
+  close(conn);
+  dup2(fds[1], STDOUT_FILENO);
+  dup2(fds[2], STDERR_FILENO);
+  if (fchdir(fds[0]) != 0)
+    die("cannot enter the client's working directory");
+  for (int i = 0; i < 3; i++)
+    if (fds[i] > STDERR_FILENO)
+      close(fds[i]);
+
+  size_t argc = 1;
+  for (uint32_t i = 0; i < len; i++)
+    argc += args[i] == 0;
+  char **argv = (char **)xmalloc((argc + 1) * sizeof(char *));
+  argv[0] = "api_tool";
+  for (size_t i = 1, off = 0; i < argc; i++) {
+    argv[i] = args + off;
+    off += strlen(args + off) + 1;
+  }
+  argv[argc] = NULL;
+  if (argc < 2)
+    die("empty request");
+  Options q;
+  parse_options(&q, (int)argc, argv);
+  if (!is_query(q.cmd))
+    die("the server answers gen, search and needs");
+  if (q.root_given) {
+    char *root = realpath(q.root, NULL);
+    if (!root || strcmp(root, sv->root) != 0) {
+      fprintf(stderr, "error: this server indexes %s\n", sv->root);
+      exit(1);
+    }
+    free(root);
+  }
+  int status = run_command(&q, &sn->view);
+  if (q.show_stats)
+    print_stats();
+  free(argv);
+  free(args);
+  exit(status);
+}
+
+static void serve_accept(Server *sv) {
+  int conn = accept(sv->listen_fd, NULL, NULL);
+  if (conn < 0)
+    return;
+  fcntl(conn, F_SETFD, FD_CLOEXEC);
+  // Queries run as the server's user, so only that user may send them.
+  struct ucred cred = {0, (uid_t)-1, (gid_t)-1};
+  socklen_t cred_len = sizeof(cred);
+  if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0 ||
+      cred.uid != getuid()) {
+    fprintf(stderr, "refused a request from uid %ld\n", (long)cred.uid);
+    close(conn);
+    return;
+  }
+  // The child gets its own copy of the pinned snapshot, so the pin only has
+  // to last until fork() returns.
+  Snapshot *sn = serve_pin(sv);
+  fflush(NULL);
+  pid_t pid = fork();
+  if (pid == 0)
+    serve_query(sv, conn, sn);
+  snapshot_put(sn);
+  if (pid < 0) {
+    close(conn); // the client reports the dropped request
+    return;
+  }
+  if (sv->nqueries == sv->queries_cap) {
+    sv->queries_cap = sv->queries_cap ? sv->queries_cap * 2 : 16;
+    sv->queries = (ServeQuery *)xrealloc(
+        sv->queries, sv->queries_cap * sizeof(ServeQuery));
+  }
+  sv->queries[sv->nqueries++] = (ServeQuery){pid, conn};
+}
+
+// Pass the exit status of every finished query to its client.
+static void serve_reap(Server *sv) {
+  int st;
+  pid_t pid;
+  while ((pid = waitpid(-1, &st, WNOHANG)) > 0) {
+    for (size_t i = 0; i < sv->nqueries; i++) {
+      if (sv->queries[i].pid != pid)
+        continue;
+      int code = WIFEXITED(st) ? WEXITSTATUS(st) : 128 + WTERMSIG(st);
+      unsigned char status = (unsigned char)code;
+      send(sv->queries[i].conn, &status, 1, MSG_NOSIGNAL);
+      close(sv->queries[i].conn);
+      sv->queries[i] = sv->queries[--sv->nqueries];
+      break;
+    }
+  }
+}
+
+static int serve_listen(const char *path) {
+  int probe = connect_server(path);
+  if (probe >= 0) {
+    close(probe);
+    fprintf(stderr, "error: a server is already listening on %s\n", path);
+    exit(1);
+  }
+  unlink(path); // left behind by a server that did not shut down
+  struct sockaddr_un addr;
+  socket_addr(&addr, path);
+  int s = socket(AF_UNIX, SOCK_STREAM, 0);
+  mode_t old_mask = umask(077); // the socket is created 0600
+  bool bound = s >= 0 && bind(s, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+  umask(old_mask);
+  if (!bound || listen(s, 64) != 0) {
+    fprintf(stderr, "error: cannot listen on %s: %s\n", path,
+            strerror(errno));
+    exit(1);
+  }
+  fcntl(s, F_SETFD, FD_CLOEXEC);
+  return s;
+}
+
+static int serve_main(const Options *o) {
+  Server sv;
+  memset(&sv, 0, sizeof(sv));
+  sv.o = o;
+  g_no_mmap = true;
+  atomic_init(&sv.current, NULL);
+  atomic_init(&sv.pinning, 0);
+  sv.root = realpath(o->root, NULL);
+  if (!sv.root)
+    die("cannot resolve --root");
+  sv.root_fd = open(sv.root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  sv.ino = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (sv.root_fd < 0 || sv.ino < 0)
+    die("cannot watch --root");
+  serve_watch(&sv, "", false); // before the scan, so no change is missed
+  if (sv.watch_failed)
+    die("not serving a tree that is only partly watched");
+  serve_load(&sv);
+  serve_publish(&sv);
+  sv.changed = false;
+  Snapshot *first = atomic_load(&sv.current);
+  size_t nsyms = first->view.len, nfiles = first->nfiles;
+
+  // Signals are read from a descriptor, so the loop below waits on one
+  // poll(); children unblock them again. Blocked before the updater starts,
+  // so it inherits the mask.
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGHUP);
+  sigprocmask(SIG_BLOCK, &mask, NULL);
+  sv.sig_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (sv.sig_fd < 0)
+    die("signalfd failed");
+  pthread_atfork(serve_fork_lock, serve_fork_unlock, serve_fork_child);
+  if (pipe(sv.stop_pipe) != 0)
+    die("pipe failed");
+  fcntl(sv.stop_pipe[0], F_SETFD, FD_CLOEXEC);
+  fcntl(sv.stop_pipe[1], F_SETFD, FD_CLOEXEC);
+  pthread_t updater;
+  if (pthread_create(&updater, NULL, serve_updater, &sv) != 0)
+    die("cannot start the updater thread");
+  char *sock = o->socket_path ? xstrdup(o->socket_path)
+                              : path_join(sv.root, ".api_tool.sock");
+  sv.listen_fd = serve_listen(sock);
+  fprintf(stderr, "serving %s on %s: %zu symbols in %zu files\n", sv.root,
+          sock, nsyms, nfiles);
+
+  struct pollfd pf[2] = {{sv.sig_fd, POLLIN, 0}, {sv.listen_fd, POLLIN, 0}};
+  for (bool run = true; run;) {
+    if (poll(pf, 2, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      die("poll failed");
+    }
+    if (pf[0].revents) {
+      struct signalfd_siginfo si;
+      while (read(sv.sig_fd, &si, sizeof(si)) == (ssize_t)sizeof(si))
+        if (si.ssi_signo != SIGCHLD)
+          run = false;
+      serve_reap(&sv);
+    }
+    if (pf[1].revents)
+      serve_accept(&sv);
   }
 
-  usage();
-  free_syms(&syms);
+  if (write(sv.stop_pipe[1], "", 1) != 1)
+    die("cannot stop the updater thread");
+  pthread_join(updater, NULL);
+
+  unlink(sock);
+  free(sock);
+  close(sv.listen_fd);
+  close(sv.sig_fd);
+  close(sv.ino);
+  close(sv.stop_pipe[0]);
+  close(sv.stop_pipe[1]);
+  close(sv.root_fd);
+  for (size_t i = 0; i < sv.nqueries; i++)
+    close(sv.queries[i].conn);
+  free(sv.queries);
+  for (size_t i = 0; i < sv.watch_cap; i++)
+    free(sv.watch_dir[i]);
+  free(sv.watch_dir);
+  free(sv.dirty);
+  for (size_t i = 0; i < sv.nfiles; i++)
+    serve_file_put(sv.files[i]);
+  free(sv.files);
+  snapshot_put(atomic_load(&sv.current));
+  free(sv.root);
+  return 0;
+}
+
+#else
+
+static int serve_main(const Options *o) {
+  (void)o;
+  die("serve needs inotify, which is Linux only");
   return 1;
 }
+
+#endif
+
+/* =======================
+   Main
+   ======================= */
+
+int main(int argc, char **argv) {
+  simd_init();
+  intern_init();
+  jobserver_init();
+  if (argc < 2) {
+    usage();
+    return 1;
+  }
+  Options o;
+  parse_options(&o, argc, argv);
+  if (strcmp(o.cmd, "serve") == 0)
+    return serve_main(&o);
+  if (!is_query(o.cmd)) {
+    usage();
+    return 1;
+  }
+  if (o.socket_path)
+    return client_main(&o, argc, argv);
+
+  int status;
+  if (strcmp(o.cmd, "gen") == 0) {
+    status = cmd_gen(&o, NULL);
+  } else {
+    SymVec syms = {0};
+    char *cache_path = cache_path_of(&o);
+    scan_tree(o.root, o.jobs, cache_path, &syms);
+    free(cache_path);
+    status = run_command(&o, &syms);
+    free_syms(&syms);
+  }
+  if (o.show_stats)
+    print_stats();
+  return status;
+}
@@ -0,0 +1,59 @@
+#!/bin/sh
+# Annotation lookback test. An "@api" or "@backend" tag applies to a symbol
+# when it sits in the 6 lines before the symbol's first line; a tag 7 lines
+# back or on the symbol line itself does not. Files live under src/, so
+# untagged symbols are PRIVATE. Exits 1 on any mismatch.
+#
+#   tests/annotations.sh            (CC and CFLAGS are honoured)
+
+set -e
+here=$(cd "$(dirname "$0")" && pwd)
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+${CC:-cc} ${CFLAGS:--O2} -std=c11 -pthread "$here/../api_tool.c" \
+  -o "$tmp/api_tool"
+
+# pad n: n blank lines
+pad() { i=0; while [ "$i" -lt "$1" ]; do echo; i=$((i + 1)); done; }
+
+mkdir -p "$tmp/root/src"
+{
+  echo '// @api public'; pad 5; echo 'int six_back(void);'
+  echo; echo '// @api public'; pad 6; echo 'int seven_back(void);'
+  echo; echo 'int own_line(void); // @api public'
+  echo; echo '// @api public'; echo 'int one_back(void);'
+} > "$tmp/root/src/vis.h"
+{
+  echo '// @backend sdl'; pad 5
+  echo 'typedef struct SixBack { int a; } SixBack;'
+  echo; echo '// @backend sdl'; pad 6
+  echo 'typedef struct SevenBack { int a; } SevenBack;'
+} > "$tmp/root/src/backend.h"
+
+status=0
+"$tmp/api_tool" search --root "$tmp/root" --no-cache |
+  sed -n 's/^== \([A-Z]*\)\/[a-z_]*: \([A-Za-z_]*\) .*/\1 \2/p' |
+  sort > "$tmp/got"
+printf '%s\n' 'PRIVATE SevenBack' 'PRIVATE SixBack' 'PRIVATE own_line' \
+  'PRIVATE seven_back' 'PUBLIC one_back' 'PUBLIC six_back' > "$tmp/want"
+if ! diff "$tmp/want" "$tmp/got"; then
+  echo "visibility differs: < expected, > got" >&2
+  status=1
+fi
+
+# The backend shows up in the index; untagged symbols are "core".
+"$tmp/api_tool" gen --root "$tmp/root" --no-cache --out "$tmp/api.def" \
+  --index "$tmp/index.json" >/dev/null
+backend() { # name
+  sed -n "s/.*\"name\":\"$1\".*\"backend\":\"\([a-z]*\)\".*/\1/p" \
+    "$tmp/index.json"
+}
+if [ "$(backend SixBack)" != sdl ]; then
+  echo "@backend 6 lines back was not applied" >&2
+  status=1
+fi
+if [ "$(backend SevenBack)" != core ]; then
+  echo "@backend 7 lines back was applied" >&2
+  status=1
+fi
+exit $status
@@ -0,0 +1,70 @@
+#!/bin/sh
+# Line-index scaling benchmark. Scans one synthetic header of 25k, 50k,
+# 100k and 200k lines (prototypes, annotated structs, block comments) and
+# prints the scan time per line, which stays flat while the line number and
+# snippet lookups are linear. Exits 1 if the largest size costs more than 3x
+# per line what the smallest does.
+#
+#   tests/bench_lines.sh            (CC and CFLAGS are honoured)
+
+set -e
+here=$(cd "$(dirname "$0")" && pwd)
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+${CC:-cc} ${CFLAGS:--O2} -std=c11 -pthread "$here/../api_tool.c" \
+  -o "$tmp/api_tool"
+
+gen_header() { # lines out
+  awk -v n="$1" 'BEGIN {
+    print "#pragma once"
+    for (i = 0; lines < n; i++) {
+      if (i % 10 == 0) {
+        printf "// @api public\n// @backend sdl\ntypedef struct S%d {\n", i
+        printf "  int a;\n  float b; /* { */\n} S%d;\n", i
+        lines += 6
+      } else if (i % 10 == 5) {
+        printf "/* block\n   comment */\nstruct T%d {\n  char c;\n};\n", i
+        lines += 5
+      } else {
+        printf "int fn_%d(int a, S0 *b);\n", i
+        lines += 1
+      }
+    }
+  }' > "$2"
+}
+
+now_ns() { date +%s%N; }
+
+# Best of three runs, in ns.
+scan_ns() {
+  best=
+  for _ in 1 2 3; do
+    t0=$(now_ns)
+    "$tmp/api_tool" search --root "$1" --no-cache --name none_such >/dev/null
+    t=$(($(now_ns) - t0))
+    if [ -z "$best" ] || [ "$t" -lt "$best" ]; then best=$t; fi
+  done
+  echo "$best"
+}
+
+mkdir "$tmp/empty"
+startup=$(scan_ns "$tmp/empty")
+
+printf '%8s %10s %10s\n' lines ms ns/line
+first= last=
+for n in 25000 50000 100000 200000; do
+  mkdir "$tmp/t$n"
+  gen_header "$n" "$tmp/t$n/big.h"
+  ns=$(($(scan_ns "$tmp/t$n") - startup))
+  per=$((ns / n))
+  [ "$per" -gt 0 ] || per=1
+  printf '%8d %10d.%01d %10d\n' "$n" $((ns / 1000000)) \
+    $((ns / 100000 % 10)) "$per"
+  [ -n "$first" ] || first=$per
+  last=$per
+done
+
+if [ "$last" -gt $((first * 3)) ]; then
+  echo "not linear: $last ns/line at 200k lines vs $first at 25k" >&2
+  exit 1
+fi
@@ -0,0 +1,134 @@
+// Microbenchmark for the structural character kernels. Every available
+// classify kernel (scalar, SSE2, AVX2) is checked against the scalar one
+// over the whole buffer, then timed; so are two consumers of the masks,
+// the line index and the comment stripper (timed with the copy that
+// restores its input), with each kernel plugged in.
+// Exits 1 if a kernel disagrees with the scalar masks.
+//
+//   cc -O2 -std=c11 -pthread tests/bench_masks.c -o bench_masks
+//   ./bench_masks [file ...]   (default: 64 MiB of synthetic C)
+
+#define main api_tool_main
+#include "../api_tool.c"
+#undef main
+
+#include <time.h>
+
+typedef struct {
+  const char *name;
+  void (*fn)(const unsigned char *, BlockMasks *);
+} Kernel;
+
+static double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void synth(Buf *b, size_t size) {
+  static const char unit[] =
+      "// @api public\n"
+      "typedef struct Vec2 { float x, y; } Vec2; /* { not a brace } */\n"
+      "static const char *names[] = {\"a;b\", \"{c}\", '\\\\'};\n"
+      "#define SQR(x) ((x) * (x))\n"
+      "int vec2_dot(const Vec2 *a,\n"
+      "             const Vec2 *b);\n"
+      "void draw(int x, int y) {\n  if (x) { y++; }\n}\n";
+  while (b->len < size)
+    buf_put(b, unit, sizeof(unit) - 1);
+}
+
+// Seconds for the fastest of `reps` runs of `body`.
+#define BEST(reps, secs, body)                                                 \
+  do {                                                                         \
+    secs = 1e30;                                                               \
+    for (int rep_ = 0; rep_ < (reps); rep_++) {                                \
+      double t0_ = now_s();                                                    \
+      body;                                                                    \
+      double t_ = now_s() - t0_;                                               \
+      if (t_ < secs)                                                           \
+        secs = t_;                                                             \
+    }                                                                          \
+  } while (0)
+
+int main(int argc, char **argv) {
+  simd_init();
+  Buf text = {0};
+  for (int i = 1; i < argc; i++) {
+    SrcFile *src = src_load_at(AT_FDCWD, argv[i]);
+    if (!src) {
+      fprintf(stderr, "skipping %s: empty or unreadable\n", argv[i]);
+      continue;
+    }
+    buf_put(&text, src->data, src->len);
+    src_free(src);
+  }
+  if (argc < 2)
+    synth(&text, 64u << 20);
+  size_t n = text.len & ~(size_t)63;
+  const unsigned char *p = (const unsigned char *)text.data;
+  double mb = (double)text.len / 1e6;
+
+  Kernel kernels[3];
+  size_t nk = 0;
+  kernels[nk++] = (Kernel){"scalar", classify_scalar};
+#if defined(__SSE2__)
+  kernels[nk++] = (Kernel){"sse2", classify_sse2};
+#if defined(HAVE_AVX2_KERNEL)
+  if (__builtin_cpu_supports("avx2"))
+    kernels[nk++] = (Kernel){"avx2", classify_avx2};
+#endif
+#endif
+
+  const char *chosen = "?";
+  for (size_t k = 0; k < nk; k++)
+    if (kernels[k].fn == classify_block)
+      chosen = kernels[k].name;
+  printf("%.1f MB; kernel picked at startup: %s\n", mb, chosen);
+  printf("%-8s %12s %14s %14s\n", "kernel", "classify", "line index",
+         "strip comments");
+  int status = 0;
+  char *copy = (char *)xmalloc(text.len + 1);
+  for (size_t k = 0; k < nk; k++) {
+    for (size_t i = 0; i < n; i += 64) {
+      BlockMasks want, got;
+      classify_scalar(p + i, &want);
+      kernels[k].fn(p + i, &got);
+      if (memcmp(&want, &got, sizeof(want)) != 0) {
+        fprintf(stderr, "%s: masks differ at offset %zu\n", kernels[k].name,
+                i);
+        status = 1;
+        break;
+      }
+    }
+
+    double classify, index, strip;
+    uint64_t sink = 0;
+    BEST(5, classify, {
+      for (size_t i = 0; i < n; i += 64) {
+        BlockMasks m;
+        kernels[k].fn(p + i, &m);
+        sink += m.bits[CLS_NEWLINE] ^ m.bits[CLS_BRACE];
+      }
+    });
+    classify_block = kernels[k].fn;
+    BEST(5, index, {
+      LineIndex li;
+      line_index_build(&li, text.data, text.len);
+      sink += li.count;
+      line_index_free(&li);
+    });
+    BEST(5, strip, {
+      memcpy(copy, text.data, text.len);
+      strip_comments(copy, text.len);
+      sink += (unsigned char)copy[text.len / 2];
+    });
+    if (sink == 42)
+      puts(""); // keep the loops
+    printf("%-8s %7.0f MB/s %9.0f MB/s %9.0f MB/s\n", kernels[k].name,
+           mb / classify, mb / index, mb / strip);
+  }
+  free(copy);
+  free(text.data);
+  return status;
+}
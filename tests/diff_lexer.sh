@@ -0,0 +1,92 @@
+#!/bin/sh
+# Differential test of the declaration lexer plus scan throughput. Builds
+# the scanner at revisions BASE (default HEAD~1) and NEW (default HEAD;
+# "tree" uses the working tree), runs both over a corpus and diffs the
+# symbol sets. To check the lexer against the POSIX regex extractors it
+# replaced, pass the commit that introduced it and its parent. Symbols are
+# compared by visibility, kind, name, file and last line: the lexer anchors
+# a struct at its own line rather than at blank lines before it, so first
+# lines differ. The working tree is also checked against the expected
+# symbols of tests/lexer_corpus. Exits 1 on any difference.
+#
+#   tests/diff_lexer.sh [BASE [NEW [corpus dir]]]
+#                       (default corpus: C headers of /usr/include)
+
+set -e
+here=$(cd "$(dirname "$0")" && pwd)
+repo=$(cd "$here/.." && pwd)
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+BASE=${1:-HEAD~1}
+NEW=${2:-HEAD}
+
+build() { # rev out
+  if [ "$1" = tree ]; then
+    cp "$repo/api_tool.c" "$tmp/$2.c"
+  else
+    git -C "$repo" show "$1:api_tool.c" > "$tmp/$2.c"
+  fi
+  ${CC:-cc} ${CFLAGS:--O2} -std=c11 -pthread -w "$tmp/$2.c" -o "$tmp/$2"
+}
+build "$BASE" base
+build "$NEW" new
+build tree tree
+
+corpus=$3
+if [ -z "$corpus" ]; then
+  corpus=$tmp/corpus
+  mkdir -p "$corpus"
+  cp /usr/include/*.h "$corpus"
+  [ -d /usr/include/linux ] && cp -r /usr/include/linux "$corpus"
+fi
+bytes=$(find "$corpus" -type f \( -name '*.[ch]' -o -name '*.cc' \
+  -o -name '*.cpp' -o -name '*.hpp' \) -exec cat {} + | wc -c)
+
+# Revisions with the scan cache need --no-cache; older ones reject it.
+flags() { "$tmp/$1" search --root "$tmp" --no-cache --name none_such \
+  >/dev/null 2>&1 && echo --no-cache; }
+
+symbols() { # bin out
+  "$tmp/$1" search --root "$corpus" $(flags "$1") |
+    sed -n 's/^== \(.*\)  (\(.*\):[0-9]*-\([0-9]*\)) ==$/\1 \2:\3/p' |
+    sort > "$2"
+}
+
+# Best of three, in MB/s.
+throughput() {
+  best=
+  for _ in 1 2 3; do
+    t0=$(date +%s%N)
+    "$tmp/$1" search --root "$corpus" $(flags "$1") --name none_such \
+      >/dev/null
+    t=$(($(date +%s%N) - t0))
+    if [ -z "$best" ] || [ "$t" -lt "$best" ]; then best=$t; fi
+  done
+  awk -v b="$bytes" -v t="$best" 'BEGIN { printf "%.1f", b * 1000 / t }'
+}
+
+symbols base "$tmp/base.syms"
+symbols new "$tmp/new.syms"
+echo "corpus: $bytes bytes, $(wc -l < "$tmp/base.syms") symbols"
+printf '%-24s %8s MB/s\n' "base ($BASE)" "$(throughput base)" \
+  "new ($NEW)" "$(throughput new)" "working tree" "$(throughput tree)"
+
+status=0
+if ! diff "$tmp/base.syms" "$tmp/new.syms" > "$tmp/diff"; then
+  grep '^[<>]' "$tmp/diff" | head -n 50
+  echo "symbol sets differ: < $BASE, > $NEW" >&2
+  status=1
+else
+  echo "symbol sets identical"
+fi
+
+# Regression cases: the working tree must give exactly these symbols, with
+# their full line ranges, over tests/lexer_corpus.
+"$tmp/tree" search --root "$here/lexer_corpus" --no-cache |
+  sed -n 's/^== \(.*\)  (\(.*\)) ==$/\1 \2/p' | sort > "$tmp/corpus.syms"
+if ! diff "$here/lexer_corpus.syms" "$tmp/corpus.syms"; then
+  echo "tests/lexer_corpus: < expected, > working tree" >&2
+  status=1
+fi
+exit $status
@@ -0,0 +1,28 @@
+/* Return types on a line of their own (GNU and Win32 style) next to
+   declaration macros that must not be taken for one. */
+#pragma once
+
+__BEGIN_DECLS
+
+BOOL
+gnu_bool(int a);
+
+HRESULT
+Bar(void *p);
+
+LRESULT CALLBACK
+WndProc(HWND h, UINT m, WPARAM w, LPARAM l);
+
+EXPORT
+int after_export(void);
+
+G_BEGIN_DECLS
+typedef struct Pair {
+  int a, b;
+} Pair;
+
+STATUS
+pair_sum(const Pair *p,
+         int *out);
+
+__END_DECLS
@@ -0,0 +1,45 @@
+#!/bin/sh
+# Scan cache staleness test. A same-size edit whose mtime is put back with
+# touch -d must still be seen (the record also keys on ctime), and so must
+# one made right after a scan to a file that still carries that scan's
+# timestamp (a racily clean record is checked against the content). Exits 1
+# if a search returns the symbol from before the edit.
+#
+#   tests/scan_cache.sh             (CC and CFLAGS are honoured)
+
+set -e
+here=$(cd "$(dirname "$0")" && pwd)
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+${CC:-cc} ${CFLAGS:--O2} -std=c11 -pthread "$here/../api_tool.c" \
+  -o "$tmp/api_tool"
+
+mkdir -p "$tmp/root/src"
+h=$tmp/root/src/a.h
+status=0
+# expect name: the search finds exactly `name`
+expect() {
+  got=$("$tmp/api_tool" search --root "$tmp/root" |
+    sed -n 's/^== [A-Z]*\/[a-z_]*: \([a-z]*\) .*/\1/p')
+  if [ "$got" != "$1" ]; then
+    echo "$2: expected $1, got ${got:-nothing}" >&2
+    status=1
+  fi
+}
+
+echo 'int cccc(void);' > "$h"
+touch -d '2020-01-01 12:00:00' "$h"
+expect cccc "first scan"
+echo 'int dddd(void);' > "$h"
+touch -d '2020-01-01 12:00:00' "$h"
+expect dddd "mtime restored after the edit"
+
+rm -f "$tmp/root/.api_tool_cache"
+now=$(date +%s)
+echo 'int eeee(void);' > "$h"
+touch -d "@$now" "$h"
+expect eeee "fresh file"
+echo 'int ffff(void);' > "$h"
+touch -d "@$now" "$h"
+expect ffff "edit in the same second as the scan"
+exit $status
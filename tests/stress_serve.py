@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+# Stress test for serve's snapshot publication (Linux). Builds api_tool
+# (or takes API_TOOL), generates a tree of filler headers plus MARKERS
+# marker headers each defining one struct burst_<i>, and serves it. Reader
+# threads then run `search --pattern burst_` over the socket while the main
+# thread keeps rewriting every marker (write + rename, so each file is
+# always complete on disk) and appending to the filler, which keeps the
+# updater merging. Whatever snapshot a query pins, it must list every
+# marker exactly once. Prints query latency; exits 1 on any failed or
+# inconsistent query, or on a sanitizer report from the server (point
+# API_TOOL at an ASan or TSan build).
+#
+#   tests/stress_serve.py [--seconds N] [--readers N] [--files N]
+
+import argparse
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+MARKERS = 200
+
+
+def build(tmp):
+    if os.environ.get("API_TOOL"):
+        return os.path.abspath(os.environ["API_TOOL"])
+    src = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..",
+                       "api_tool.c")
+    out = os.path.join(tmp, "api_tool")
+    cmd = [os.environ.get("CC", "cc")]
+    cmd += os.environ.get("CFLAGS", "-O2").split()
+    cmd += ["-std=c11", "-pthread", src, "-o", out]
+    subprocess.run(cmd, check=True)
+    return out
+
+
+def write_marker(tree, i, version):
+    path = os.path.join(tree, "burst", "b%d.h" % i)
+    with open(path + ".tmp", "w") as f:
+        f.write("struct burst_%d { int v%d; };\n" % (i, version))
+    os.rename(path + ".tmp", path)
+
+
+def make_tree(tree, nfiles):
+    os.makedirs(os.path.join(tree, "burst"))
+    filler = []
+    for d in range(nfiles // 100 + 1):
+        os.makedirs(os.path.join(tree, "d%d" % d))
+    for n in range(nfiles):
+        path = os.path.join(tree, "d%d" % (n // 100), "f%d.h" % n)
+        with open(path, "w") as f:
+            for k in range(20):
+                f.write("int fill_%d_%d(int a, const char *b);\n" % (n, k))
+            f.write("typedef struct Fill%d {\n  int x;\n} Fill%d;\n" % (n, n))
+        filler.append(path)
+    for i in range(MARKERS):
+        write_marker(tree, i, 0)
+    return filler
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("--seconds", type=float, default=15)
+    ap.add_argument("--readers", type=int, default=4)
+    ap.add_argument("--files", type=int, default=4000)
+    args = ap.parse_args()
+
+    tmp = tempfile.mkdtemp()
+    server = None
+    try:
+        tool = build(tmp)
+        tree = os.path.join(tmp, "tree")
+        filler = make_tree(tree, args.files)
+        sock = os.path.join(tmp, "serve.sock")
+        log_path = os.path.join(tmp, "serve.log")
+        log = open(log_path, "w")
+        server = subprocess.Popen(
+            [tool, "serve", "--root", tree, "--socket", sock, "--no-cache"],
+            stderr=log)
+        deadline = time.time() + 60
+        while not os.path.exists(sock):
+            if server.poll() is not None or time.time() > deadline:
+                sys.exit("the server did not start")
+            time.sleep(0.05)
+
+        stop = threading.Event()
+        lock = threading.Lock()
+        latencies, bad = [], []
+
+        def reader():
+            while not stop.is_set():
+                t0 = time.time()
+                r = subprocess.run(
+                    [tool, "search", "--socket", sock, "--pattern", "burst_"],
+                    capture_output=True, text=True)
+                dt = time.time() - t0
+                found = r.stdout.count("\n== ")
+                with lock:
+                    latencies.append(dt)
+                    if r.returncode != 0 or found != MARKERS:
+                        bad.append((r.returncode, found, r.stderr[:200]))
+
+        threads = [threading.Thread(target=reader)
+                   for _ in range(args.readers)]
+        for t in threads:
+            t.start()
+        bursts = 0
+        end = time.time() + args.seconds
+        try:
+            while time.time() < end:
+                bursts += 1
+                for i in range(MARKERS):
+                    write_marker(tree, i, bursts)
+                for path in filler:
+                    with open(path, "a") as f:
+                        f.write("// %d\n" % bursts)
+                time.sleep(0.05)
+        finally:
+            stop.set()
+            for t in threads:
+                t.join()
+
+        if server.poll() is not None:
+            bad.append(("server exited", server.returncode, ""))
+        server.terminate()
+        server.wait()
+        log.close()
+        with open(log_path) as f:
+            report = f.read()
+        if "Sanitizer" in report:
+            print(report)
+            bad.append(("sanitizer report from the server", 0, ""))
+        latencies.sort()
+        n = len(latencies)
+        if n:
+            print("%d bursts, %d queries: p50 %.1f ms, p99 %.1f ms, "
+                  "max %.1f ms" % (bursts, n, latencies[n // 2] * 1000,
+                                   latencies[min(n - 1, n * 99 // 100)] * 1000,
+                                   latencies[-1] * 1000))
+        for b in bad[:10]:
+            print("bad query:", b)
+        if bad or not n:
+            print("FAIL: %d of %d queries failed or were inconsistent"
+                  % (len(bad), n))
+            sys.exit(1)
+        print("ok")
+    finally:
+        if server and server.poll() is None:
+            server.terminate()
+            server.wait()
+        shutil.rmtree(tmp, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    main()